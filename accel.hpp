@@ -0,0 +1,93 @@
+#ifndef ACCEL_HPP
+#define ACCEL_HPP
+
+#include <cfloat>
+#include <cstddef>
+#include "ray.hpp"
+#include "tristore.hpp"
+
+// Counters of the last-hit cache of stream queries
+struct CacheStats {
+	unsigned long long tested;	// Rays that tested the previous ray's triangle before traversal
+	unsigned long long hits;	// Rays that hit it, so traversal started from its distance
+	CacheStats() : tested(0), hits(0) {}
+};
+
+// Common interface of the ray acceleration structures used by the ray caster
+class Accel {
+public:
+	virtual ~Accel() {}
+
+	// Find the closest hit along the ray, return false if nothing is hit
+	bool intersect(const Ray& ray, float& tHit, unsigned int& triIdx) const;
+	// Closest hit nearer than the one tHit and triIdx already hold, or as near with a lower index,
+	// tHit is FLT_MAX when they hold none. Returns whether they hold a hit afterwards
+	// A good hit to start from lets the traversal cull everything behind it
+	virtual bool intersectCloser(const Ray& ray, float& tHit, unsigned int& triIdx) const = 0;
+	// Same, filling a hit record whose barycentrics are computed once for the closest triangle
+	bool intersect(const Ray& ray, Hit& hit) const;
+	// Whether anything is hit along the ray within [tMin, tMax], for shadow and visibility rays
+	// Returns at the first hit found, which need not be the closest one
+	virtual bool occluded(const Ray& ray, float tMin, float tMax) const = 0;
+
+	// Stream queries over count rays at once, for callers that have a whole batch of rays ready
+	// Results land at the same index as their ray, the structure may group or reorder the work inside
+	// Each ray first tests the triangle the previous ray hit, neighboring pixels mostly share it
+	virtual void intersect(const Ray* rays, unsigned int count, Hit* hits, CacheStats* stats = NULL) const;
+	virtual void occluded(const Ray* rays, unsigned int count, float tMin, float tMax, bool* blocked) const;
+
+	// Memory used by the structure in bytes, the triangles themselves excluded
+	virtual size_t memoryUsage() const = 0;
+	// Triangles the structure was built over, in mesh order
+	virtual const TriangleStore& triangles() const = 0;
+};
+
+inline bool Accel::intersect(const Ray& ray, float& tHit, unsigned int& triIdx) const {
+	tHit = FLT_MAX;
+	return intersectCloser(ray, tHit, triIdx);
+}
+
+inline bool Accel::intersect(const Ray& ray, Hit& hit) const {
+	hit = Hit();
+	float t;
+	unsigned int triIdx;
+	if (!intersect(ray, t, triIdx))
+		return false;
+	hit.t = t;
+	hit.triIdx = triIdx;
+	triangles().intersect(ray, triIdx, hit.bary);
+	return true;
+}
+
+inline void Accel::intersect(const Ray* rays, unsigned int count, Hit* hits, CacheStats* stats) const {
+	const TriangleStore& tris = triangles();
+	unsigned int lastTri = Hit::NONE;
+	unsigned long long tested = 0, cached = 0;
+	for (unsigned int i = 0; i < count; i++) {
+		Hit& hit = hits[i];
+		hit = Hit();
+		if (lastTri != Hit::NONE) {
+			tested++;
+			float t = tris.intersect(rays[i], lastTri);
+			if (t >= 0.0f) {
+				hit.t = t;
+				hit.triIdx = lastTri;
+				cached++;
+			}
+		}
+		if (intersectCloser(rays[i], hit.t, hit.triIdx))
+			tris.intersect(rays[i], hit.triIdx, hit.bary);
+		lastTri = hit.triIdx;
+	}
+	if (stats) {
+		stats->tested += tested;
+		stats->hits += cached;
+	}
+}
+
+inline void Accel::occluded(const Ray* rays, unsigned int count, float tMin, float tMax, bool* blocked) const {
+	for (unsigned int i = 0; i < count; i++)
+		blocked[i] = occluded(rays[i], tMin, tMax);
+}
+
+#endif
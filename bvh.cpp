@@ -0,0 +1,464 @@
+#include "bvh.hpp"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include "mappedfile.hpp"
+using namespace std;
+using namespace glm;
+
+// Build parameters
+const int SAH_BINS = 16;				// Centroid bins evaluated per axis
+const float SAH_TRAVERSAL_COST = 1.0f;	// Cost of a node visit relative to one triangle test
+
+// Sidecar file layout: CacheHeader, then the nodes, then triIndices
+const unsigned int CACHE_MAGIC = 0x48564247;	// "GBVH"
+const unsigned int CACHE_VERSION = 1;			// Bump when the node format or the build changes
+struct CacheHeader {
+	unsigned int magic;
+	unsigned int version;
+	unsigned long long sourceHash;
+	unsigned int nodeSize;
+	unsigned int triCount;
+	unsigned int nodeCount;
+	unsigned int reserved;
+};
+
+// Surface area of a box (half of it, the factor cancels out in the heuristic)
+static float halfArea(const vec3& minBB, const vec3& maxBB) {
+	vec3 e = maxBB - minBB;
+	return e.x * e.y + e.y * e.z + e.z * e.x;
+}
+
+BVH::BVH() {
+	tris = NULL;
+}
+
+void BVH::clear() {
+	nodes.clear();
+	triIndices.clear();
+	leafTris.clear();
+	tris = NULL;
+}
+
+void BVH::build(const TriangleStore& tris) {
+	clear();
+	this->tris = &tris;
+	const vector<Mesh::Vtx>& verts = tris.vertices();
+	unsigned int triCount = verts.size() / 3;
+	if (triCount == 0)
+		return;
+
+	// Triangle bounds and centroids used while splitting
+	vector<vec3> triMin(triCount), triMax(triCount), centroids(triCount);
+	triIndices.resize(triCount);
+	for (unsigned int i = 0; i < triCount; i++) {
+		const vec3& v1 = verts[3 * i + 0].pos;
+		const vec3& v2 = verts[3 * i + 1].pos;
+		const vec3& v3 = verts[3 * i + 2].pos;
+		triMin[i] = glm::min(v1, glm::min(v2, v3));
+		triMax[i] = glm::max(v1, glm::max(v2, v3));
+		centroids[i] = (triMin[i] + triMax[i]) * 0.5f;
+		triIndices[i] = i;
+	}
+
+	// Create the root and split recursively
+	nodes.reserve(2 * triCount - 1);
+	Node root;
+	root.leftFirst = 0;
+	root.triCount = triCount;
+	nodes.push_back(root);
+	subdivide(0, centroids, triMin, triMax, 0);
+	nodes.shrink_to_fit();
+	leafTris.build(verts, triIndices);
+}
+
+void BVH::subdivide(unsigned int nodeIdx, const vector<vec3>& centroids,
+	const vector<vec3>& triMin, const vector<vec3>& triMax, int depth) {
+	unsigned int first = nodes[nodeIdx].leftFirst;
+	unsigned int count = nodes[nodeIdx].triCount;
+
+	// Fit the node and its centroid bounds to the triangles
+	vec3 minBB(FLT_MAX), maxBB(-FLT_MAX);
+	vec3 minC(FLT_MAX), maxC(-FLT_MAX);
+	for (unsigned int i = first; i < first + count; i++) {
+		unsigned int tri = triIndices[i];
+		minBB = glm::min(minBB, triMin[tri]);
+		maxBB = glm::max(maxBB, triMax[tri]);
+		minC = glm::min(minC, centroids[tri]);
+		maxC = glm::max(maxC, centroids[tri]);
+	}
+	nodes[nodeIdx].minBB = minBB;
+	nodes[nodeIdx].maxBB = maxBB;
+	if (count <= 1 || depth >= MAX_DEPTH)
+		return;
+
+	// Sweep the binned centroids of every axis for the cheapest split
+	int bestAxis = -1, bestSplit = 0;
+	float bestCost = FLT_MAX;
+	for (int axis = 0; axis < 3; axis++) {
+		float extent = maxC[axis] - minC[axis];
+		if (extent <= 0.0f)
+			continue;
+		float binScale = SAH_BINS / extent;
+
+		unsigned int binCount[SAH_BINS] = { 0 };
+		vec3 binMin[SAH_BINS], binMax[SAH_BINS];
+		for (int b = 0; b < SAH_BINS; b++) {
+			binMin[b] = vec3(FLT_MAX);
+			binMax[b] = vec3(-FLT_MAX);
+		}
+		for (unsigned int i = first; i < first + count; i++) {
+			unsigned int tri = triIndices[i];
+			int b = std::min(SAH_BINS - 1, (int)((centroids[tri][axis] - minC[axis]) * binScale));
+			binCount[b]++;
+			binMin[b] = glm::min(binMin[b], triMin[tri]);
+			binMax[b] = glm::max(binMax[b], triMax[tri]);
+		}
+
+		// Accumulate areas from the left, then evaluate each plane from the right
+		float leftArea[SAH_BINS - 1];
+		unsigned int leftCount[SAH_BINS - 1];
+		vec3 accMin(FLT_MAX), accMax(-FLT_MAX);
+		unsigned int accCount = 0;
+		for (int b = 0; b < SAH_BINS - 1; b++) {
+			accCount += binCount[b];
+			accMin = glm::min(accMin, binMin[b]);
+			accMax = glm::max(accMax, binMax[b]);
+			leftCount[b] = accCount;
+			leftArea[b] = accCount ? halfArea(accMin, accMax) : 0.0f;
+		}
+		accMin = vec3(FLT_MAX);
+		accMax = vec3(-FLT_MAX);
+		accCount = 0;
+		for (int b = SAH_BINS - 1; b > 0; b--) {
+			accCount += binCount[b];
+			accMin = glm::min(accMin, binMin[b]);
+			accMax = glm::max(accMax, binMax[b]);
+			if (accCount == 0 || leftCount[b - 1] == 0)
+				continue;
+			float cost = leftCount[b - 1] * leftArea[b - 1] + accCount * halfArea(accMin, accMax);
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestAxis = axis;
+				bestSplit = b;
+			}
+		}
+	}
+	if (bestAxis < 0)
+		return;
+
+	// Keep small nodes as leaves when splitting does not pay off
+	float parentArea = halfArea(minBB, maxBB);
+	float splitCost = SAH_TRAVERSAL_COST + (parentArea > 0.0f ? bestCost / parentArea : 0.0f);
+	if (splitCost >= count && count <= MAX_LEAF_TRIS)
+		return;
+
+	// Partition the triangles on the chosen plane
+	float binScale = SAH_BINS / (maxC[bestAxis] - minC[bestAxis]);
+	unsigned int* mid = std::partition(&triIndices[first], &triIndices[first] + count,
+		[&](unsigned int tri) {
+			int b = std::min(SAH_BINS - 1, (int)((centroids[tri][bestAxis] - minC[bestAxis]) * binScale));
+			return b < bestSplit;
+		});
+	unsigned int leftCount = mid - &triIndices[first];
+	if (leftCount == 0 || leftCount == count)
+		return;
+
+	// Children are stored next to each other
+	unsigned int leftIdx = nodes.size();
+	Node left, right;
+	left.leftFirst = first;
+	left.triCount = leftCount;
+	right.leftFirst = first + leftCount;
+	right.triCount = count - leftCount;
+	nodes.push_back(left);
+	nodes.push_back(right);
+	nodes[nodeIdx].leftFirst = leftIdx;
+	nodes[nodeIdx].triCount = 0;
+
+	subdivide(leftIdx, centroids, triMin, triMax, depth + 1);
+	subdivide(leftIdx + 1, centroids, triMin, triMax, depth + 1);
+}
+
+bool BVH::intersectCloser(const Ray& ray, float& tHit, unsigned int& triIdx) const {
+	if (!nodes.empty())
+		traverse(ray, 1.0f / ray.dir, 0, tHit, triIdx);	// Zero direction components become infinities
+	return tHit != FLT_MAX;
+}
+
+bool BVH::traverse(const Ray& ray, const vec3& invDir, unsigned int rootIdx, float& tHit, unsigned int& triIdx) const {
+	bool hit = false;
+
+	// Depth-first, nearest child first
+	unsigned int stack[MAX_DEPTH + 4];
+	int stackSize = 0;
+	if (intersectBox(ray.orig, invDir, nodes[rootIdx].minBB, nodes[rootIdx].maxBB, tHit) == FLT_MAX)
+		return false;
+	stack[stackSize++] = rootIdx;
+	while (stackSize > 0) {
+		const Node& node = nodes[stack[--stackSize]];
+		if (node.triCount > 0) {
+			// Leaf: test its triangles together, ties go to the lower index like a linear scan
+			if (leafTris.intersectRange(ray, node.leftFirst, node.triCount, tHit, triIdx))
+				hit = true;
+			continue;
+		}
+
+		// Interior: push the children that are hit, farther one first
+		unsigned int leftIdx = node.leftFirst;
+		float tLeft = intersectBox(ray.orig, invDir, nodes[leftIdx].minBB, nodes[leftIdx].maxBB, tHit);
+		float tRight = intersectBox(ray.orig, invDir, nodes[leftIdx + 1].minBB, nodes[leftIdx + 1].maxBB, tHit);
+		if (tLeft <= tRight) {
+			if (tRight != FLT_MAX) stack[stackSize++] = leftIdx + 1;
+			if (tLeft != FLT_MAX) stack[stackSize++] = leftIdx;
+		} else {
+			if (tLeft != FLT_MAX) stack[stackSize++] = leftIdx;
+			if (tRight != FLT_MAX) stack[stackSize++] = leftIdx + 1;
+		}
+	}
+
+	return hit;
+}
+
+bool BVH::occluded(const Ray& ray, float tMin, float tMax) const {
+	if (nodes.empty())
+		return false;
+	vec3 invDir = 1.0f / ray.dir;	// Zero direction components become infinities
+	if (intersectBox(ray.orig, invDir, nodes[0].minBB, nodes[0].maxBB, tMax) == FLT_MAX)
+		return false;
+	if (nodes[0].triCount > 0)
+		return leafTris.occludedRange(ray, nodes[0].leftFirst, nodes[0].triCount, tMin, tMax);
+
+	// Any hit ends the search, so leaf children are tested as soon as they are reached, nearer one
+	// first, and only interior children wait on the stack
+	unsigned int stack[MAX_DEPTH + 4];
+	int stackSize = 0;
+	stack[stackSize++] = 0;
+	while (stackSize > 0) {
+		const Node& node = nodes[stack[--stackSize]];
+		unsigned int leftIdx = node.leftFirst;
+		float tLeft = intersectBox(ray.orig, invDir, nodes[leftIdx].minBB, nodes[leftIdx].maxBB, tMax);
+		float tRight = intersectBox(ray.orig, invDir, nodes[leftIdx + 1].minBB, nodes[leftIdx + 1].maxBB, tMax);
+		unsigned int near = tLeft <= tRight ? leftIdx : leftIdx + 1;
+		unsigned int far = near == leftIdx ? leftIdx + 1 : leftIdx;
+		float tNear = glm::min(tLeft, tRight), tFar = glm::max(tLeft, tRight);
+
+		const Node& nearNode = nodes[near];
+		const Node& farNode = nodes[far];
+		if (tNear != FLT_MAX && nearNode.triCount > 0 &&
+			leafTris.occludedRange(ray, nearNode.leftFirst, nearNode.triCount, tMin, tMax))
+			return true;
+		if (tFar != FLT_MAX && farNode.triCount > 0 &&
+			leafTris.occludedRange(ray, farNode.leftFirst, farNode.triCount, tMin, tMax))
+			return true;
+		if (tFar != FLT_MAX && farNode.triCount == 0) stack[stackSize++] = far;
+		if (tNear != FLT_MAX && nearNode.triCount == 0) stack[stackSize++] = near;
+	}
+
+	return false;
+}
+
+void BVH::intersect(const RayPacket& packet, Hit hits[]) const {
+	for (int r = 0; r < packet.count; r++)
+		hits[r] = Hit();
+	if (nodes.empty())
+		return;
+
+	// Nodes are culled for the whole packet against the farthest closest hit of its rays
+	struct Entry {
+		unsigned int idx;
+		float t;	// Lower bound of the packet's entry distance
+	};
+	float packetMax = FLT_MAX;
+	Entry stack[MAX_DEPTH + 4];
+	int stackSize = 0;
+	Entry root = { 0, packet.intersectBox(nodes[0].minBB, nodes[0].maxBB, packetMax) };
+	if (root.t == FLT_MAX)
+		return;
+	stack[stackSize++] = root;
+	while (stackSize > 0) {
+		Entry entry = stack[--stackSize];
+		const Node& node = nodes[entry.idx];
+
+		// Once the packet is wider than the node its rays stop sharing the subtree, trace them one by one
+		vec3 extent = node.maxBB - node.minBB;
+		if (packet.spread(entry.t) > glm::max(extent.x, glm::max(extent.y, extent.z))) {
+			packetMax = 0.0f;
+			for (int r = 0; r < packet.count; r++) {
+				traverse(packet.rays[r], packet.invDir[r], entry.idx, hits[r].t, hits[r].triIdx);
+				packetMax = std::max(packetMax, hits[r].t);
+			}
+			continue;
+		}
+
+		if (node.triCount > 0) {
+			// Leaf: only the rays that hit its box test its triangles
+			int active[RayPacket::MAX_RAYS];
+			int activeCount = 0;
+			for (int r = 0; r < packet.count; r++)
+				if (intersectBox(packet.rays[r].orig, packet.invDir[r], node.minBB, node.maxBB, hits[r].t) != FLT_MAX)
+					active[activeCount++] = r;
+			for (unsigned int i = node.leftFirst; i < node.leftFirst + node.triCount && activeCount > 0; i++) {
+				unsigned int tri = triIndices[i];
+				const Mesh::Vtx* triangle = &tris->vertices()[3 * tri];
+				// Skip triangles whose box the packet misses
+				vec3 triMin = glm::min(triangle[0].pos, glm::min(triangle[1].pos, triangle[2].pos));
+				vec3 triMax = glm::max(triangle[0].pos, glm::max(triangle[1].pos, triangle[2].pos));
+				if (packet.intersectBox(triMin, triMax, packetMax) == FLT_MAX)
+					continue;
+				for (int a = 0; a < activeCount; a++) {
+					int r = active[a];
+					float t = tris->intersect(packet.rays[r], tri);
+					if (t >= 0.0f && (t < hits[r].t || (t == hits[r].t && tri < hits[r].triIdx))) {
+						hits[r].t = t;
+						hits[r].triIdx = tri;
+					}
+				}
+			}
+			packetMax = 0.0f;
+			for (int r = 0; r < packet.count; r++)
+				packetMax = std::max(packetMax, hits[r].t);
+			continue;
+		}
+
+		// Interior: push the children the packet may hit, farther one first
+		unsigned int leftIdx = node.leftFirst;
+		Entry left = { leftIdx, packet.intersectBox(nodes[leftIdx].minBB, nodes[leftIdx].maxBB, packetMax) };
+		Entry right = { leftIdx + 1, packet.intersectBox(nodes[leftIdx + 1].minBB, nodes[leftIdx + 1].maxBB, packetMax) };
+		if (left.t <= right.t) {
+			if (right.t != FLT_MAX) stack[stackSize++] = right;
+			if (left.t != FLT_MAX) stack[stackSize++] = left;
+		} else {
+			if (left.t != FLT_MAX) stack[stackSize++] = left;
+			if (right.t != FLT_MAX) stack[stackSize++] = right;
+		}
+	}
+
+	// Barycentrics of the closest triangles only
+	for (int r = 0; r < packet.count; r++)
+		if (hits[r].valid())
+			tris->intersect(packet.rays[r], hits[r].triIdx, hits[r].bary);
+}
+
+void BVH::intersect(const Ray* rays, unsigned int count, Hit* hits, CacheStats* stats) const {
+	if (nodes.empty()) {
+		Accel::intersect(rays, count, hits, stats);
+		return;
+	}
+	// Packets wider than this share of the model where they cross it split within the first few levels,
+	// and the frustum tests up to there cost more than they save
+	const float MAX_SPREAD = 0.125f;
+	vec3 extent = nodes[0].maxBB - nodes[0].minBB;
+	float maxSpread = MAX_SPREAD * glm::max(extent.x, glm::max(extent.y, extent.z));
+	float halfDiag = 0.5f * length(extent);
+
+	for (unsigned int first = 0; first < count; first += RayPacket::MAX_RAYS) {
+		RayPacket packet;
+		for (unsigned int i = first; i < count && i < first + RayPacket::MAX_RAYS; i++)
+			packet.add(rays[i]);
+		packet.finish();
+
+		// Runs whose rays diverge too much to bound them together are traced ray by ray, the decision
+		// is made for each run so the parts of a view where the rays stay close still go as packets
+		float tEnter = packet.intersectBox(nodes[0].minBB, nodes[0].maxBB, FLT_MAX);
+		bool tight = tEnter == FLT_MAX || packet.spread(tEnter + halfDiag) <= maxSpread;
+		if (packet.coherent() && tight)
+			intersect(packet, &hits[first]);
+		else
+			Accel::intersect(&rays[first], packet.count, &hits[first], stats);
+	}
+}
+
+size_t BVH::memoryUsage() const {
+	return nodes.size() * sizeof(Node) + triIndices.size() * sizeof(unsigned int);
+}
+
+bool BVH::loadCache(const string& filename, unsigned long long sourceHash, const TriangleStore& tris) {
+	MappedFile file;
+	if (sourceHash == 0 || !file.open(filename) || file.size() < sizeof(CacheHeader))
+		return false;
+	CacheHeader header;
+	memcpy(&header, file.data(), sizeof(header));
+	unsigned int triCount = tris.size();
+	if (header.magic != CACHE_MAGIC || header.version != CACHE_VERSION || header.sourceHash != sourceHash ||
+		header.nodeSize != sizeof(Node) || header.triCount != triCount || header.nodeCount == 0 ||
+		file.size() != sizeof(CacheHeader) + (size_t)header.nodeCount * sizeof(Node) + (size_t)triCount * sizeof(unsigned int))
+		return false;
+	const Node* fileNodes = (const Node*)(file.data() + sizeof(CacheHeader));
+	const unsigned int* fileTris = (const unsigned int*)(fileNodes + header.nodeCount);
+
+	// Reject references a damaged file could make out of range, children always follow their parent
+	// The nodes must form a tree: every node but the root is named as a child by exactly one parent before
+	// it is reached, so depths are final when checked and no shared child can hide a deeper chain
+	vector<unsigned char> depth(header.nodeCount, 0);
+	vector<bool> named(header.nodeCount, false);
+	for (unsigned int i = 0; i < header.nodeCount; i++) {
+		const Node& node = fileNodes[i];
+		if (i > 0 && !named[i])
+			return false;
+		if (node.triCount > 0) {
+			if (node.leftFirst > triCount || node.triCount > triCount - node.leftFirst)
+				return false;
+		} else {
+			if (node.leftFirst <= i || node.leftFirst >= header.nodeCount - 1 || depth[i] >= MAX_DEPTH)
+				return false;
+			if (named[node.leftFirst] || named[node.leftFirst + 1])
+				return false;
+			named[node.leftFirst] = named[node.leftFirst + 1] = true;
+			depth[node.leftFirst] = depth[node.leftFirst + 1] = depth[i] + 1;
+		}
+	}
+	for (unsigned int i = 0; i < triCount; i++)
+		if (fileTris[i] >= triCount)
+			return false;
+
+	clear();
+	this->tris = &tris;
+	nodes.assign(fileNodes, fileNodes + header.nodeCount);
+	triIndices.assign(fileTris, fileTris + triCount);
+	leafTris.build(tris.vertices(), triIndices);
+	return true;
+}
+
+bool BVH::saveCache(const string& filename, unsigned long long sourceHash) const {
+	if (nodes.empty() || sourceHash == 0)
+		return false;
+	ofstream file(filename, ios::binary | ios::trunc);
+	if (!file.is_open())
+		return false;
+	CacheHeader header;
+	header.magic = CACHE_MAGIC;
+	header.version = CACHE_VERSION;
+	header.sourceHash = sourceHash;
+	header.nodeSize = sizeof(Node);
+	header.triCount = triIndices.size();
+	header.nodeCount = nodes.size();
+	header.reserved = 0;
+	file.write((const char*)&header, sizeof(header));
+	file.write((const char*)nodes.data(), nodes.size() * sizeof(Node));
+	file.write((const char*)triIndices.data(), triIndices.size() * sizeof(unsigned int));
+	return file.good();
+}
+
+float intersectBox(const vec3& orig, const vec3& invDir, const vec3& minBB, const vec3& maxBB, float tMax) {
+	// Far distances are widened by a few ulps so rounding never loses flat boxes or
+	// equal-distance hits, which can then still win ties
+	const float ROUNDING = 1.0f + 4.0f * FLT_EPSILON;
+	float tEnter = 0.0f;
+	float tExit = tMax * ROUNDING;
+	for (int i = 0; i < 3; i++) {
+		float tNear = (minBB[i] - orig[i]) * invDir[i];
+		float tFar = (maxBB[i] - orig[i]) * invDir[i];
+		if (tNear > tFar)
+			std::swap(tNear, tFar);
+		tFar *= ROUNDING;
+		// Written so that the NaN of a ray lying in a slab plane (0 * inf) leaves the interval unchanged
+		tEnter = tNear > tEnter ? tNear : tEnter;
+		tExit = tFar < tExit ? tFar : tExit;
+		if (tEnter > tExit)
+			return FLT_MAX;
+	}
+	return tEnter;
+}
@@ -0,0 +1,79 @@
+#ifndef BVH_HPP
+#define BVH_HPP
+
+#include <string>
+#include <vector>
+#include <glm/glm.hpp>
+#include "mesh.hpp"
+#include "ray.hpp"
+#include "tristore.hpp"
+#include "accel.hpp"
+
+// Bounding volume hierarchy over a triangle list, built with the surface area heuristic
+class BVH : public Accel {
+public:
+	BVH();
+
+	// Build over the triangles of a store
+	// The store is referenced, not copied, and must outlive the hierarchy
+	void build(const TriangleStore& tris);
+	// Faster build for geometry that changes every frame (linear BVH): sort the triangles along a
+	// Morton curve in parallel and derive the tree from the sorted codes. When optimize is set,
+	// subtrees the surface area heuristic prefers as leaves are collapsed. Traces slower than build
+	void buildLinear(const TriangleStore& tris, bool optimize = true);
+	void clear();
+
+	// Closest hit nearer than the one tHit and triIdx already hold, see Accel
+	bool intersectCloser(const Ray& ray, float& tHit, unsigned int& triIdx) const;
+	using Accel::intersect;
+	// Whether anything is hit within [tMin, tMax], stopping at the first hit found
+	bool occluded(const Ray& ray, float tMin, float tMax) const;
+	using Accel::occluded;
+	// Closest hit of every ray of a coherent packet, same results as tracing them one by one
+	void intersect(const RayPacket& packet, Hit hits[]) const;
+	// Stream of rays, each run of RayPacket::MAX_RAYS consecutive rays is traced as one packet when coherent
+	// and narrow next to the model, so callers should order the rays by blocks of neighboring pixels
+	void intersect(const Ray* rays, unsigned int count, Hit* hits, CacheStats* stats = NULL) const;
+	size_t memoryUsage() const;
+
+	// Sidecar file holding a built hierarchy, keyed by a hash of the model file it was built from
+	// Loading returns false if the file is missing, stale, damaged or made for other triangles
+	bool loadCache(const std::string& filename, unsigned long long sourceHash, const TriangleStore& tris);
+	bool saveCache(const std::string& filename, unsigned long long sourceHash) const;
+
+	// Build parameters shared by both builds
+	static const unsigned int MAX_LEAF_TRIS = 8;	// Leaves larger than this are always split when possible
+	static const int MAX_DEPTH = 60;				// Keeps traversal within its fixed-size stack
+
+	// Triangles the hierarchy was built over
+	const TriangleStore& triangles() const { return *tris; }
+	// The same triangles in triIndices order, each leaf's triangles are one slot range
+	// Triangle data like the store, so memoryUsage leaves it out
+	const TriangleStore& leafTriangles() const { return leafTris; }
+
+	// Node format (32 bytes)
+	struct Node {
+		glm::vec3 minBB;
+		unsigned int leftFirst;		// Left child index (right is +1), or first entry of triIndices
+		glm::vec3 maxBB;
+		unsigned int triCount;		// Number of triangles in a leaf, 0 for interior nodes
+	};
+	// Hierarchy data, the root is nodes[0]
+	std::vector<Node> nodes;
+	std::vector<unsigned int> triIndices;
+
+protected:
+	const TriangleStore* tris;	// Triangles the hierarchy was built over
+	TriangleStore leafTris;		// Copy in leaf order, loaded by the wide kernels without gathers
+
+	// Continue the closest hit search of a ray in the subtree of a node, return true if a closer hit was found
+	bool traverse(const Ray& ray, const glm::vec3& invDir, unsigned int rootIdx, float& tHit, unsigned int& triIdx) const;
+	void subdivide(unsigned int nodeIdx, const std::vector<glm::vec3>& centroids,
+		const std::vector<glm::vec3>& triMin, const std::vector<glm::vec3>& triMax, int depth);
+};
+
+// Slab test against a box within [0, tMax], return the entry distance or FLT_MAX on a miss
+float intersectBox(const glm::vec3& orig, const glm::vec3& invDir,
+	const glm::vec3& minBB, const glm::vec3& maxBB, float tMax);
+
+#endif
@@ -0,0 +1,253 @@
+#include "bvh4.hpp"
+#include <cfloat>
+#include <cmath>
+using namespace std;
+using namespace glm;
+
+// Traversal stack size, enough for 3 pending siblings on each of the binary build's 60 levels
+const int STACK_SIZE = 192;
+
+BVH4::BVH4() {
+	bvh = NULL;
+}
+
+void BVH4::clear() {
+	nodes.clear();
+	cones.clear();
+	bvh = NULL;
+}
+
+void BVH4::build(const BVH& bvh, bool cullBackFaces) {
+	clear();
+	this->bvh = &bvh;
+	if (bvh.nodes.empty())
+		return;
+	collapse(0, cullBackFaces);
+	nodes.shrink_to_fit();
+	cones.shrink_to_fit();
+}
+
+unsigned int BVH4::collapse(unsigned int binIdx, bool withCones) {
+	const vector<BVH::Node>& binNodes = bvh->nodes;
+
+	// Open the largest interior child until 4 children are gathered
+	unsigned int children[4];
+	int childCount = 0;
+	if (binNodes[binIdx].triCount > 0) {
+		// A leaf root becomes the only child of the root
+		children[childCount++] = binIdx;
+	} else {
+		children[childCount++] = binNodes[binIdx].leftFirst;
+		children[childCount++] = binNodes[binIdx].leftFirst + 1;
+	}
+	while (childCount < 4) {
+		int best = -1;
+		float bestArea = -1.0f;
+		for (int i = 0; i < childCount; i++) {
+			const BVH::Node& c = binNodes[children[i]];
+			if (c.triCount > 0)
+				continue;
+			vec3 e = c.maxBB - c.minBB;
+			float area = e.x * e.y + e.y * e.z + e.z * e.x;
+			if (area > bestArea) {
+				bestArea = area;
+				best = i;
+			}
+		}
+		if (best < 0)
+			break;
+		unsigned int left = binNodes[children[best]].leftFirst;
+		children[best] = left;
+		children[childCount++] = left + 1;
+	}
+
+	// Fill the slots, unused ones get an inverted box that no ray can hit
+	unsigned int nodeIdx = nodes.size();
+	nodes.push_back(Node());
+	if (withCones) {
+		cones.push_back(Cones());
+		for (int i = 0; i < 4; i++) {
+			vec4 cone = i < childCount ? normalCone(children[i]) : vec4(0.0f, 0.0f, 0.0f, 1.0f);
+			Cones& c = cones[nodeIdx];
+			c.axisX[i] = cone.x; c.axisY[i] = cone.y; c.axisZ[i] = cone.z;
+			c.cutoff[i] = cone.w;
+		}
+	}
+	for (int i = 0; i < 4; i++) {
+		Node& node = nodes[nodeIdx];
+		if (i >= childCount) {
+			node.minX[i] = node.minY[i] = node.minZ[i] = FLT_MAX;
+			node.maxX[i] = node.maxY[i] = node.maxZ[i] = -FLT_MAX;
+			node.child[i] = 0;
+			node.triCount[i] = 0;
+			continue;
+		}
+		const BVH::Node& c = binNodes[children[i]];
+		node.minX[i] = c.minBB.x; node.minY[i] = c.minBB.y; node.minZ[i] = c.minBB.z;
+		node.maxX[i] = c.maxBB.x; node.maxY[i] = c.maxBB.y; node.maxZ[i] = c.maxBB.z;
+		node.triCount[i] = c.triCount;
+		node.child[i] = c.leftFirst;
+	}
+	// Interior children are collapsed after the slots are filled, nodes may reallocate
+	for (int i = 0; i < childCount; i++) {
+		if (binNodes[children[i]].triCount == 0) {
+			unsigned int childIdx = collapse(children[i], withCones);
+			nodes[nodeIdx].child[i] = childIdx;
+		}
+	}
+
+	return nodeIdx;
+}
+
+// Cone of a subtree's face normals as (axis, cutoff)
+vec4 BVH4::normalCone(unsigned int binIdx) const {
+	const vec4 never(0.0f, 0.0f, 0.0f, 1.0f);
+	const vector<BVH::Node>& binNodes = bvh->nodes;
+	const TriangleStore& tris = bvh->leafTriangles();
+
+	// The subtree's triangles are the leaf slots from its leftmost to its rightmost leaf
+	unsigned int first = binIdx, last = binIdx;
+	while (binNodes[first].triCount == 0)
+		first = binNodes[first].leftFirst;
+	while (binNodes[last].triCount == 0)
+		last = binNodes[last].leftFirst + 1;
+	unsigned int begin = binNodes[first].leftFirst, end = binNodes[last].leftFirst + binNodes[last].triCount;
+
+	// Axis along the mean face normal, degenerate triangles are never hit and do not count
+	vec3 sum(0.0f);
+	for (unsigned int k = begin; k < end; k++) {
+		vec3 n = cross(vec3(tris.e1x[k], tris.e1y[k], tris.e1z[k]), vec3(tris.e2x[k], tris.e2y[k], tris.e2z[k]));
+		if (length(n) > 0.0f)
+			sum += normalize(n);
+	}
+	if (length(sum) == 0.0f)
+		return never;
+	vec3 axis = normalize(sum);
+
+	// Widest angle between the axis and a normal
+	float minCos = 1.0f;
+	for (unsigned int k = begin; k < end; k++) {
+		vec3 n = cross(vec3(tris.e1x[k], tris.e1y[k], tris.e1z[k]), vec3(tris.e2x[k], tris.e2y[k], tris.e2z[k]));
+		if (length(n) > 0.0f)
+			minCos = glm::min(minCos, dot(axis, normalize(n)));
+	}
+	if (minCos <= 0.0f)
+		return never;
+
+	// A direction closer to the axis than 90 degrees minus that angle makes a positive dot product
+	// with every normal. The margin covers the rounding of both dot products
+	const float MARGIN = 1e-4f;
+	float cutoff = std::sqrt(1.0f - minCos * minCos) + MARGIN;
+	return cutoff < 1.0f ? vec4(axis, cutoff) : never;
+}
+
+int BVH4::backFacing(unsigned int nodeIdx, const vec3& dir) const {
+	const Cones& c = cones[nodeIdx];
+	__m128 d = _mm_mul_ps(_mm_loadu_ps(c.axisX), _mm_set1_ps(dir.x));
+	d = _mm_add_ps(d, _mm_mul_ps(_mm_loadu_ps(c.axisY), _mm_set1_ps(dir.y)));
+	d = _mm_add_ps(d, _mm_mul_ps(_mm_loadu_ps(c.axisZ), _mm_set1_ps(dir.z)));
+	return _mm_movemask_ps(_mm_cmpgt_ps(d, _mm_loadu_ps(c.cutoff)));
+}
+
+// Test the 4 child boxes of a node, returns the mask of the slots hit and stores their entry distances
+static inline int intersectChildren(const BVH4::Node& node, const SlabRay& r, float tMax, float dist[4]) {
+	return intersectBoxes4(r, _mm_loadu_ps(node.minX), _mm_loadu_ps(node.minY), _mm_loadu_ps(node.minZ),
+		_mm_loadu_ps(node.maxX), _mm_loadu_ps(node.maxY), _mm_loadu_ps(node.maxZ), tMax, dist);
+}
+
+bool BVH4::intersectCloser(const Ray& ray, float& tHit, unsigned int& triIdx) const {
+	bool hit = tHit != FLT_MAX;
+	if (nodes.empty())
+		return hit;
+	const TriangleStore& tris = bvh->leafTriangles();
+	const float ROUNDING = 1.0f + 4.0f * FLT_EPSILON;	// Same widening as intersectBox
+	SlabRay slabRay(ray);
+	vec3 dir = cones.empty() ? vec3(0.0f) : normalize(ray.dir);
+
+	struct Entry {
+		unsigned int idx;		// Node index, or first leaf slot for leaves
+		unsigned int triCount;	// 0 for nodes
+		float t;				// Entry distance of the box
+	};
+	Entry stack[STACK_SIZE];
+	int stackSize = 0;
+	Entry root = { 0, 0, 0.0f };
+	stack[stackSize++] = root;
+	while (stackSize > 0) {
+		Entry entry = stack[--stackSize];
+		// Skip boxes that lie behind a hit found since they were pushed
+		if (entry.t > tHit * ROUNDING)
+			continue;
+
+		if (entry.triCount > 0) {
+			// Leaf: test its triangles together, ties go to the lower index like a linear scan
+			if (tris.intersectRange(ray, entry.idx, entry.triCount, tHit, triIdx))
+				hit = true;
+			continue;
+		}
+
+		const Node& node = nodes[entry.idx];
+		float dist[4];
+		int mask = intersectChildren(node, slabRay, tHit, dist);
+		if (!cones.empty())
+			mask &= ~backFacing(entry.idx, dir);
+		if (mask == 0)
+			continue;
+
+		// Sort the hit children by distance, farthest first, and push them
+		Entry hits[4];
+		int hitCount = 0;
+		for (int i = 0; i < 4; i++) {
+			if (!(mask & (1 << i)))
+				continue;
+			Entry e = { node.child[i], node.triCount[i], dist[i] };
+			int j = hitCount++;
+			while (j > 0 && hits[j - 1].t < e.t) {
+				hits[j] = hits[j - 1];
+				j--;
+			}
+			hits[j] = e;
+		}
+		for (int i = 0; i < hitCount; i++)
+			stack[stackSize++] = hits[i];
+	}
+
+	return hit;
+}
+
+bool BVH4::occluded(const Ray& ray, float tMin, float tMax) const {
+	if (nodes.empty())
+		return false;
+	const TriangleStore& tris = bvh->leafTriangles();
+	SlabRay slabRay(ray);
+	vec3 dir = cones.empty() ? vec3(0.0f) : normalize(ray.dir);
+
+	// Any hit ends the search and tMax never shrinks, so nothing is sorted or culled again:
+	// the leaves among the children hit are tested right away, the interior ones are pushed as they come
+	unsigned int stack[STACK_SIZE];
+	int stackSize = 0;
+	stack[stackSize++] = 0;
+	while (stackSize > 0) {
+		unsigned int nodeIdx = stack[--stackSize];
+		const Node& node = nodes[nodeIdx];
+		float dist[4];
+		int mask = intersectChildren(node, slabRay, tMax, dist);
+		if (!cones.empty())
+			mask &= ~backFacing(nodeIdx, dir);
+		for (int i = 0; i < 4; i++) {
+			if (!(mask & (1 << i)))
+				continue;
+			if (node.triCount[i] == 0)
+				stack[stackSize++] = node.child[i];
+			else if (tris.occludedRange(ray, node.child[i], node.triCount[i], tMin, tMax))
+				return true;
+		}
+	}
+
+	return false;
+}
+
+size_t BVH4::memoryUsage() const {
+	// Leaves are slot ranges of the binary build's leaf-ordered triangles, which are triangle data
+	return nodes.size() * sizeof(Node) + cones.size() * sizeof(Cones);
+}
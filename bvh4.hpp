@@ -0,0 +1,107 @@
+#ifndef BVH4_HPP
+#define BVH4_HPP
+
+#include <cfloat>
+#include <vector>
+#include <xmmintrin.h>
+#include <glm/glm.hpp>
+#include "mesh.hpp"
+#include "ray.hpp"
+#include "bvh.hpp"
+#include "accel.hpp"
+
+// 4-wide bounding volume hierarchy, collapsed from a binary BVH
+// Each node stores its 4 child boxes in SoA form so one SSE pass tests the ray against all of them
+class BVH4 : public Accel {
+public:
+	BVH4();
+
+	// Collapse a built binary hierarchy, which must outlive this one
+	// With cullBackFaces, subtrees whose triangles all face away from a ray are skipped (see cones),
+	// which only preserves the closest hit on closed meshes seen from outside
+	void build(const BVH& bvh, bool cullBackFaces = false);
+	void clear();
+
+	// Closest hit nearer than the one tHit and triIdx already hold, see Accel
+	bool intersectCloser(const Ray& ray, float& tHit, unsigned int& triIdx) const;
+	using Accel::intersect;
+	// Whether anything is hit within [tMin, tMax], stopping at the first hit found
+	bool occluded(const Ray& ray, float tMin, float tMax) const;
+	using Accel::occluded;
+	size_t memoryUsage() const;
+	const TriangleStore& triangles() const { return bvh->triangles(); }
+
+	// Binary hierarchy this one was collapsed from
+	const BVH& source() const { return *bvh; }
+
+	// Node format (128 bytes)
+	struct Node {
+		float minX[4], minY[4], minZ[4];	// Child boxes, empty slots are inverted boxes
+		float maxX[4], maxY[4], maxZ[4];
+		unsigned int child[4];		// Child node index, or first entry of triIndices for leaves
+		unsigned int triCount[4];	// Number of triangles of a leaf child, 0 for interior children
+	};
+	// Hierarchy data, the root is nodes[0]
+	std::vector<Node> nodes;
+
+	// Cones bounding the face normals (from the vertex winding) of every triangle below each child slot,
+	// in SoA form like the boxes. A ray whose unit direction d has dot(axis, d) > cutoff only meets the
+	// backs of these triangles. Slots that never cull have a zero axis
+	struct Cones {
+		float axisX[4], axisY[4], axisZ[4];
+		float cutoff[4];
+	};
+	// Cones of each node, empty unless built with cullBackFaces
+	std::vector<Cones> cones;
+	bool cullsBackFaces() const { return !cones.empty(); }
+
+protected:
+	const BVH* bvh;		// Binary hierarchy providing triangles and triIndices
+
+	unsigned int collapse(unsigned int binIdx, bool withCones);
+	glm::vec4 normalCone(unsigned int binIdx) const;
+	// Mask of the child slots of a node that a ray with unit direction dir would only meet from behind
+	int backFacing(unsigned int nodeIdx, const glm::vec3& dir) const;
+};
+
+// Ray data shared by the 4-wide slab tests of one traversal
+struct SlabRay {
+	bool negX, negY, negZ;		// The near plane of each slab only depends on the direction sign
+	__m128 origX, origY, origZ;
+	__m128 invX, invY, invZ;
+
+	SlabRay(const Ray& ray) {
+		glm::vec3 invDir = 1.0f / ray.dir;	// Zero components become infinities
+		negX = invDir.x < 0.0f;
+		negY = invDir.y < 0.0f;
+		negZ = invDir.z < 0.0f;
+		origX = _mm_set1_ps(ray.orig.x); origY = _mm_set1_ps(ray.orig.y); origZ = _mm_set1_ps(ray.orig.z);
+		invX = _mm_set1_ps(invDir.x); invY = _mm_set1_ps(invDir.y); invZ = _mm_set1_ps(invDir.z);
+	}
+};
+
+// Slab test of 4 boxes at once within [0, tMax], with the same widening as intersectBox
+// Returns the mask of the boxes hit and stores their entry distances
+// max/min return their second operand on NaN (ray lying in a slab plane), which keeps the interval
+inline int intersectBoxes4(const SlabRay& r, __m128 minX, __m128 minY, __m128 minZ,
+	__m128 maxX, __m128 maxY, __m128 maxZ, float tMax, float dist[4]) {
+	const float ROUNDING = 1.0f + 4.0f * FLT_EPSILON;
+	__m128 rounding = _mm_set1_ps(ROUNDING);
+	__m128 nearX = _mm_mul_ps(_mm_sub_ps(r.negX ? maxX : minX, r.origX), r.invX);
+	__m128 nearY = _mm_mul_ps(_mm_sub_ps(r.negY ? maxY : minY, r.origY), r.invY);
+	__m128 nearZ = _mm_mul_ps(_mm_sub_ps(r.negZ ? maxZ : minZ, r.origZ), r.invZ);
+	__m128 farX = _mm_mul_ps(_mm_sub_ps(r.negX ? minX : maxX, r.origX), r.invX);
+	__m128 farY = _mm_mul_ps(_mm_sub_ps(r.negY ? minY : maxY, r.origY), r.invY);
+	__m128 farZ = _mm_mul_ps(_mm_sub_ps(r.negZ ? minZ : maxZ, r.origZ), r.invZ);
+	__m128 tEnter = _mm_max_ps(nearX, _mm_setzero_ps());
+	tEnter = _mm_max_ps(nearY, tEnter);
+	tEnter = _mm_max_ps(nearZ, tEnter);
+	__m128 tExit = _mm_set1_ps(tMax * ROUNDING);
+	tExit = _mm_min_ps(_mm_mul_ps(farX, rounding), tExit);
+	tExit = _mm_min_ps(_mm_mul_ps(farY, rounding), tExit);
+	tExit = _mm_min_ps(_mm_mul_ps(farZ, rounding), tExit);
+	_mm_storeu_ps(dist, tEnter);
+	return _mm_movemask_ps(_mm_cmple_ps(tEnter, tExit));
+}
+
+#endif
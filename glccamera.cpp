@@ -0,0 +1,267 @@
+#include "glccamera.hpp"
+#include <cmath>
+#include <stdexcept>
+#include <immintrin.h>
+#include "tristore.hpp"
+using namespace std;
+using namespace glm;
+
+// Same instruction set attributes as the triangle kernels, see trikernel.cpp
+#ifdef _MSC_VER
+#define TARGET_AVX2
+#define TARGET_AVX512
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f"), optimize("fp-contract=off")))
+#endif
+
+// A run of rays is a float array of 6 floats (origin, direction) per ray, float j being base[j % 6] + k step[j % 6]
+// for the pixel k of its ray. Three vectors of W lanes hold W / 2 rays, and every lane keeps its component
+// and ray from one group of W / 2 rays to the next, so a kernel sets its lanes up once and then only moves k on
+static_assert(sizeof(Ray) == 6 * sizeof(float), "rays are generated as packed floats");
+struct RowLanes {
+	float base[48], step[48];
+	float offset[48];		// Ray of the lane within its group
+};
+
+static void setLanes(RowLanes& lanes, int width, const Ray& first, const vec3& origStep, const vec3& dirStep) {
+	for (int j = 0; j < 3 * width; j++) {
+		int c = j % 6;
+		lanes.base[j] = c < 3 ? first.orig[c] : first.dir[c - 3];
+		lanes.step[j] = c < 3 ? origStep[c] : dirStep[c - 3];
+		lanes.offset[j] = (float)(j / 6);
+	}
+}
+
+// Kernels return how many rays of the count they generated, whole groups only
+// Lane values are base + (k + offset) step with k + offset an exact integer, as in generateRow. Rows whose
+// direction is fixed step it by -0, so those lanes come out as base with no extra work
+static int generateSSE(const RowLanes& lanes, int x, int count, float* out) {
+	__m128 base[3], step[3], offset[3];
+	for (int v = 0; v < 3; v++) {
+		base[v] = _mm_loadu_ps(lanes.base + 4 * v);
+		step[v] = _mm_loadu_ps(lanes.step + 4 * v);
+		offset[v] = _mm_loadu_ps(lanes.offset + 4 * v);
+	}
+	int i = 0;
+	for (; i + 2 <= count; i += 2, out += 12) {
+		__m128 k = _mm_set1_ps((float)(x + i));
+		for (int v = 0; v < 3; v++)
+			_mm_storeu_ps(out + 4 * v, _mm_add_ps(base[v], _mm_mul_ps(_mm_add_ps(k, offset[v]), step[v])));
+	}
+	return i;
+}
+
+TARGET_AVX2 static int generateAVX2(const RowLanes& lanes, int x, int count, float* out) {
+	__m256 base[3], step[3], offset[3];
+	for (int v = 0; v < 3; v++) {
+		base[v] = _mm256_loadu_ps(lanes.base + 8 * v);
+		step[v] = _mm256_loadu_ps(lanes.step + 8 * v);
+		offset[v] = _mm256_loadu_ps(lanes.offset + 8 * v);
+	}
+	int i = 0;
+	for (; i + 4 <= count; i += 4, out += 24) {
+		__m256 k = _mm256_set1_ps((float)(x + i));
+		for (int v = 0; v < 3; v++)
+			_mm256_storeu_ps(out + 8 * v, _mm256_add_ps(base[v], _mm256_mul_ps(_mm256_add_ps(k, offset[v]), step[v])));
+	}
+	return i;
+}
+
+TARGET_AVX512 static int generateAVX512(const RowLanes& lanes, int x, int count, float* out) {
+	__m512 base[3], step[3], offset[3];
+	for (int v = 0; v < 3; v++) {
+		base[v] = _mm512_loadu_ps(lanes.base + 16 * v);
+		step[v] = _mm512_loadu_ps(lanes.step + 16 * v);
+		offset[v] = _mm512_loadu_ps(lanes.offset + 16 * v);
+	}
+	int i = 0;
+	for (; i + 8 <= count; i += 8, out += 48) {
+		__m512 k = _mm512_set1_ps((float)(x + i));
+		for (int v = 0; v < 3; v++)
+			_mm512_storeu_ps(out + 16 * v, _mm512_add_ps(base[v], _mm512_mul_ps(_mm512_add_ps(k, offset[v]), step[v])));
+	}
+	return i;
+}
+
+typedef int (*RowKernel)(const RowLanes&, int, int, float*);
+static const RowKernel rowKernels[] = { generateSSE, generateAVX2, generateAVX512 };
+static const int rowKernelWidths[] = { 4, 8, 16 };
+
+GLCCamera::GLCCamera() {
+	width = 0;
+	height = 0;
+	stStep = vec2(0.0f);
+	uvOrigin = vec2(0.0f);
+	uvFromSt = mat2(0.0f);
+	rowDirFixed = false;
+	type = DEGENERATE;
+}
+
+void GLCCamera::set(const vector<vec3>& imagePlaneVerts, const vector<vec3>& uvPlaneVerts,
+	int width, int height, float clipW, float clipH) {
+	this->width = width;
+	this->height = height;
+	stStep = vec2(clipW / width, clipH / height);
+	if (!affineMap(imagePlaneVerts, uvPlaneVerts, uvFromSt, uvOrigin))
+		throw runtime_error("GLC image plane points are collinear");
+	type = classify(uvFromSt, uvOrigin, slits);
+
+	// The row generator follows the type. The direction st - uv stays put along a row when uv changes with s
+	// at the same rate, which every orthographic camera does and no camera whose rays meet a slit or turn
+	// in both directions can. Pushbroom and twisted orthographic rays only keep their direction along one
+	// axis of the image, so for them the coefficients tell whether it is the rows
+	switch (type) {
+	case ORTHOGRAPHIC:
+		rowDirFixed = true;
+		break;
+	case PUSHBROOM:
+	case TWISTED_ORTHOGRAPHIC:
+		rowDirFixed = uvFromSt[0] == vec2(1.0f, 0.0f);
+		break;
+	default:
+		rowDirFixed = false;
+		break;
+	}
+}
+
+bool GLCCamera::affineMap(const vector<vec3>& imagePlaneVerts, const vector<vec3>& uvPlaneVerts, mat2& m, vec2& c) {
+	// Get each coord from defined verts
+	float s1 = imagePlaneVerts[0].x, t1 = imagePlaneVerts[0].y;
+	float s2 = imagePlaneVerts[1].x, t2 = imagePlaneVerts[1].y;
+	float s3 = imagePlaneVerts[2].x, t3 = imagePlaneVerts[2].y;
+	vec2 uv1(uvPlaneVerts[0]);
+	vec2 uv2(uvPlaneVerts[1]);
+	vec2 uv3(uvPlaneVerts[2]);
+
+	// Twice the signed area of the image plane triangle, the weights' common denominator
+	float det = s1 * t2 + s2 * t3 + s3 * t1 - s3 * t2 - s1 * t3 - s2 * t1;
+	if (det == 0.0f)
+		return false;
+
+	// alpha and beta as a * s + b * t + c
+	vec3 alpha = vec3(t2 - t3, s3 - s2, s2 * t3 - s3 * t2) / det;
+	vec3 beta = vec3(t3 - t1, s1 - s3, s3 * t1 - s1 * t3) / det;
+
+	// uv = alpha uv1 + beta uv2 + (1 - alpha - beta) uv3
+	vec2 d1 = uv1 - uv3, d2 = uv2 - uv3;
+	m = mat2(alpha.x * d1 + beta.x * d2, alpha.y * d1 + beta.y * d2);
+	c = uv3 + alpha.z * d1 + beta.z * d2;
+	return true;
+}
+
+GLCCamera::Type GLCCamera::classify(const vector<vec3>& imagePlaneVerts, const vector<vec3>& uvPlaneVerts, vector<Slit>& slits) {
+	slits.clear();
+	mat2 m;
+	vec2 c;
+	if (!affineMap(imagePlaneVerts, uvPlaneVerts, m, c))
+		return DEGENERATE;
+	return classify(m, c, slits);
+}
+
+GLCCamera::Type GLCCamera::classify(const mat2& m, const vec2& c, vector<Slit>& slits) {
+	slits.clear();
+
+	// The rays cross the plane z at z c + (I + z N) (s, t) with N = M - I, so the plane holds a slit where
+	// I + z N is singular: det(I + z N) = A z^2 + B z + 1 = 0 with A = det N and B = trace N
+	mat2 n = m - mat2(1.0f);
+	float a = determinant(n);
+	float b = n[0][0] + n[1][1];
+	float scale = 1.0f + glm::max(glm::max(fabs(n[0][0]), fabs(n[0][1])), glm::max(fabs(n[1][0]), fabs(n[1][1])));
+	float eps = 1e-6f * scale * scale;
+
+	if (fabs(a) <= eps) {
+		// At most one finite slit, the directions lie in a plane
+		if (fabs(b) > eps) {
+			addSlit(-1.0f / b, n, c, slits);
+			return PUSHBROOM;
+		}
+		// N is nilpotent: zero for parallel rays, otherwise the directions turn along one axis
+		bool zero = scale - 1.0f <= eps;
+		return zero ? ORTHOGRAPHIC : TWISTED_ORTHOGRAPHIC;
+	}
+
+	float disc = b * b - 4.0f * a;
+	if (disc < -eps)
+		return BILINEAR;
+	if (disc > eps) {
+		float root = std::sqrt(disc);
+		addSlit((-b - root) / (2.0f * a), n, c, slits);
+		addSlit((-b + root) / (2.0f * a), n, c, slits);
+		return CROSS_SLIT;
+	}
+	// Double root: all rays meet in a point when N is a multiple of I, otherwise they share one slit
+	addSlit(-b / (2.0f * a), n, c, slits);
+	bool scalar = fabs(n[1][0]) <= eps && fabs(n[0][1]) <= eps && fabs(n[0][0] - n[1][1]) <= eps;
+	if (scalar) {
+		slits.back().dir = vec3(0.0f);
+		return PERSPECTIVE;
+	}
+	return PENCIL;
+}
+
+void GLCCamera::addSlit(float z, const mat2& n, const vec2& c, vector<Slit>& slits) {
+	// Rays reach z c at (s, t) = 0, and the singular map spreads the others along its larger column
+	mat2 k = mat2(1.0f) + z * n;
+	vec2 along = length(k[0]) >= length(k[1]) ? k[0] : k[1];
+	Slit slit;
+	slit.point = vec3(z * c, z);
+	slit.dir = length(along) > 0.0f ? vec3(normalize(along), 0.0f) : vec3(0.0f);
+	slits.push_back(slit);
+}
+
+const char* GLCCamera::typeName(Type type) {
+	switch (type) {
+	case PERSPECTIVE: return "perspective";
+	case ORTHOGRAPHIC: return "orthographic";
+	case PUSHBROOM: return "pushbroom";
+	case CROSS_SLIT: return "cross-slit";
+	case PENCIL: return "pencil";
+	case TWISTED_ORTHOGRAPHIC: return "twisted orthographic";
+	case BILINEAR: return "bilinear";
+	case DEGENERATE: break;
+	}
+	return "degenerate";
+}
+
+Ray GLCCamera::ray(int x, int y) const {
+	Ray ray;
+	scanline(x, y, 1, mat4(1.0f), &ray);
+	return ray;
+}
+
+void GLCCamera::scanline(int x, int y, int count, const mat4& xform, Ray* rays) const {
+	// Ray of the row's first pixel, and the change from one pixel to the next
+	vec2 st = pixelPoint(0, y);
+	vec2 uv = uvPoint(st);
+	vec2 uvStep = uvFromSt[0] * stStep.x;
+	Ray first = {
+		vec3(xform * vec4(uv, 1.0f, 1.0f)),
+		vec3(xform * vec4(st - uv, -1.0f, 0.0f))
+	};
+	vec3 origStep = mat3(xform) * vec3(uvStep, 0.0f);
+	// A fixed direction steps by -0, adding it leaves any value as it is (-0 included), so the kernels
+	// keep the direction exactly as generateRow<true> does without a separate version
+	vec3 dirStep = rowDirFixed ? vec3(-0.0f) : mat3(xform) * vec3(stStep.x - uvStep.x, -uvStep.y, 0.0f);
+
+	// Whole groups with the instruction set of the triangle tests, then the rest one ray at a time
+	// The type of row is settled here, not per pixel
+	TriangleStore::Kernel kernel = TriangleStore::kernel();
+	RowLanes lanes;
+	setLanes(lanes, rowKernelWidths[kernel], first, origStep, dirStep);
+	int done = rowKernels[kernel](lanes, x, count, (float*)rays);
+	if (rowDirFixed)
+		generateRow<true>(x + done, count - done, first, origStep, dirStep, rays + done);
+	else
+		generateRow<false>(x + done, count - done, first, origStep, dirStep, rays + done);
+}
+
+template <bool DIR_FIXED>
+void GLCCamera::generateRow(int x, int count, const Ray& first, const vec3& origStep, const vec3& dirStep, Ray* rays) const {
+	for (int i = 0; i < count; i++) {
+		float k = (float)(x + i);
+		rays[i].orig = first.orig + k * origStep;
+		// A zero step would leave the direction as it is, so skipping it gives the same rays
+		rays[i].dir = DIR_FIXED ? first.dir : first.dir + k * dirStep;
+	}
+}
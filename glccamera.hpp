@@ -0,0 +1,80 @@
+#ifndef GLCCAMERA_HPP
+#define GLCCAMERA_HPP
+
+#include <vector>
+#include <glm/glm.hpp>
+#include "ray.hpp"
+
+// General linear camera given by three generator rays, each joining a point (s, t) of the image
+// plane (z = 0) to a point (u, v) of the uv plane (z = 1)
+// The ray through an image point combines the generators with the point's weights (alpha, beta) in the
+// image plane triangle, so its uv point is an affine function of (s, t). The coefficients of that function
+// are prepared once when the camera changes, after which the rays of a row differ by constant steps
+class GLCCamera {
+public:
+	// Kinds of GLC told apart by the characteristic equation, DEGENERATE when the generators' image
+	// plane points are collinear and the rays cannot cover the image
+	enum Type { PERSPECTIVE, ORTHOGRAPHIC, PUSHBROOM, CROSS_SLIT, PENCIL, TWISTED_ORTHOGRAPHIC, BILINEAR, DEGENERATE };
+	static const char* typeName(Type type);
+
+	// Line every ray of the camera passes through, a point on it and its unit direction.
+	// The center of a perspective camera is a slit with a zero direction
+	struct Slit {
+		glm::vec3 point;
+		glm::vec3 dir;
+	};
+
+	GLCCamera();
+
+	// Set the generators and the pixel grid, width x height pixels covering clipW x clipH of the image plane
+	// around its origin. Throws if the image plane points are collinear
+	void set(const std::vector<glm::vec3>& imagePlaneVerts, const std::vector<glm::vec3>& uvPlaneVerts,
+		int width, int height, float clipW, float clipH);
+
+	// Type of the camera of three generator rays, with its slits (two for cross-slit cameras, one for
+	// pushbroom and pencil ones, the center of perspective ones, none for the others)
+	static Type classify(const std::vector<glm::vec3>& imagePlaneVerts, const std::vector<glm::vec3>& uvPlaneVerts,
+		std::vector<Slit>& slits);
+
+	// Whether two cameras make the same rays for the same pixels
+	bool operator==(const GLCCamera& other) const {
+		return width == other.width && height == other.height && stStep == other.stStep &&
+			uvOrigin == other.uvOrigin && uvFromSt == other.uvFromSt;
+	}
+
+	// Image plane point (s, t) of a pixel
+	glm::vec2 pixelPoint(int x, int y) const { return glm::vec2(x - width / 2, y - height / 2) * stStep; }
+	// uv point of the ray through an image plane point
+	glm::vec2 uvPoint(const glm::vec2& st) const { return uvOrigin + uvFromSt * st; }
+	// World space ray of a pixel, from the uv plane to the image plane at t = 1
+	Ray ray(int x, int y) const;
+	// Rays of the count pixels of row y starting at column x, carried by the affine transform xform
+	// (worldToObj for object space rays). Each ray is the row's first one plus a multiple of the per-pixel
+	// step, so a pixel gets the same ray whichever run it is generated in
+	void scanline(int x, int y, int count, const glm::mat4& xform, Ray* rays) const;
+
+	int width, height;		// Pixel grid
+	glm::vec2 stStep;		// Image plane distance between neighboring pixels
+	glm::vec2 uvOrigin;		// uv point of the ray through (s, t) = (0, 0)
+	glm::mat2 uvFromSt;		// Change of the uv point per unit of s (first column) and of t (second column)
+	// Whether the rays of a row share their direction, because the uv point moves with the image point
+	// along it. Set from the type: true of orthographic cameras, and of pushbroom and twisted orthographic
+	// ones whose coefficients show their rays parallel to the planes across the rows
+	bool rowDirFixed;
+	Type type;					// Classified when the camera is set
+	std::vector<Slit> slits;
+
+protected:
+	// Map from image plane to uv plane points, false if the image plane points are collinear
+	static bool affineMap(const std::vector<glm::vec3>& imagePlaneVerts, const std::vector<glm::vec3>& uvPlaneVerts,
+		glm::mat2& m, glm::vec2& c);
+	static Type classify(const glm::mat2& m, const glm::vec2& c, std::vector<Slit>& slits);
+	static void addSlit(float z, const glm::mat2& n, const glm::vec2& c, std::vector<Slit>& slits);
+
+	// Scalar row generator, compiled once for rows whose rays share their direction and once for any others
+	// The SIMD kernels of scanline make the same rays bit for bit, and leave it the last rays of a run
+	template <bool DIR_FIXED>
+	void generateRow(int x, int count, const Ray& first, const glm::vec3& origStep, const glm::vec3& dirStep, Ray* rays) const;
+};
+
+#endif
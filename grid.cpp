@@ -0,0 +1,270 @@
+#include "grid.hpp"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include "bvh.hpp"
+using namespace std;
+using namespace glm;
+
+// Build parameters
+const float CELLS_PER_TRI = 4.0f;		// Target cell count relative to the triangle count
+const int MAX_RES = 256;				// Cells per axis at most
+// Grid choice parameters
+const unsigned int GRID_MIN_TRIS = 2000;	// Smaller meshes build a hierarchy in no time anyway
+const int FILL_RES = 16;					// Resolution of the occupancy estimate
+const float GRID_MIN_FILL = 0.15f;			// Fraction of the box's cells the triangles must touch
+const float GRID_MAX_VARIATION = 1.0f;		// Coefficient of variation of the occupied cells' loads
+// Triangle ids remembered per ray to skip triangles already tested in an earlier cell
+const int MAILBOX_SIZE = 16;
+// Triangles of a cell passed to the list test at once, the widest kernel's lane count
+const unsigned int BATCH_SIZE = 16;
+
+UniformGrid::UniformGrid() {
+	tris = NULL;
+	res = ivec3(0);
+	minBB = maxBB = cellSize = vec3(0.0f);
+}
+
+void UniformGrid::clear() {
+	cellStart.clear();
+	cellTris.clear();
+	tris = NULL;
+	res = ivec3(0);
+}
+
+// Range of cells overlapped by a box
+static void cellRange(const vec3& lo, const vec3& hi, const vec3& minBB, const vec3& invCellSize,
+	const ivec3& res, ivec3& first, ivec3& last) {
+	first = glm::clamp(ivec3((lo - minBB) * invCellSize), ivec3(0), res - 1);
+	last = glm::clamp(ivec3((hi - minBB) * invCellSize), ivec3(0), res - 1);
+}
+
+void UniformGrid::build(const TriangleStore& tris) {
+	clear();
+	this->tris = &tris;
+	const vector<Mesh::Vtx>& verts = tris.vertices();
+	unsigned int triCount = verts.size() / 3;
+	if (triCount == 0)
+		return;
+
+	// Size the cells so their count is proportional to the triangle count
+	minBB = vec3(FLT_MAX);
+	maxBB = vec3(-FLT_MAX);
+	for (unsigned int i = 0; i < verts.size(); i++) {
+		minBB = glm::min(minBB, verts[i].pos);
+		maxBB = glm::max(maxBB, verts[i].pos);
+	}
+	vec3 extent = glm::max(maxBB - minBB, vec3(1e-6f * length(maxBB - minBB) + FLT_MIN));
+	maxBB = minBB + extent;
+	float cellWidth = cbrt(extent.x * extent.y * extent.z / (CELLS_PER_TRI * triCount));
+	res = glm::clamp(ivec3(glm::ceil(extent / cellWidth)), ivec3(1), ivec3(MAX_RES));
+	cellSize = extent / vec3(res);
+	vec3 invCellSize = vec3(res) / extent;
+
+	// Count the triangles of each cell, then fill the lists behind the prefix sums
+	unsigned int cellCount = res.x * res.y * res.z;
+	cellStart.assign(cellCount + 1, 0);
+	for (int pass = 0; pass < 2; pass++) {
+		for (unsigned int i = 0; i < triCount; i++) {
+			vec3 lo = glm::min(verts[3 * i].pos, glm::min(verts[3 * i + 1].pos, verts[3 * i + 2].pos));
+			vec3 hi = glm::max(verts[3 * i].pos, glm::max(verts[3 * i + 1].pos, verts[3 * i + 2].pos));
+			ivec3 first, last;
+			cellRange(lo, hi, minBB, invCellSize, res, first, last);
+			for (int z = first.z; z <= last.z; z++)
+				for (int y = first.y; y <= last.y; y++)
+					for (int x = first.x; x <= last.x; x++) {
+						unsigned int c = x + res.x * (y + res.y * z);
+						if (pass == 0)
+							cellStart[c + 1]++;
+						else
+							cellTris[cellStart[c]++] = i;
+					}
+		}
+		if (pass == 0) {
+			for (unsigned int c = 0; c < cellCount; c++)
+				cellStart[c + 1] += cellStart[c];
+			cellTris.resize(cellStart[cellCount]);
+		} else {
+			// Filling advanced every start to the next cell's start
+			for (unsigned int c = cellCount; c > 0; c--)
+				cellStart[c] = cellStart[c - 1];
+			cellStart[0] = 0;
+		}
+	}
+}
+
+// State of a 3D-DDA walk through the cells a ray crosses
+struct CellWalk {
+	ivec3 cell;			// Current cell
+	ivec3 step, out;	// Cell step along each axis, and the coordinate just outside the grid
+	vec3 tNext;			// Ray distance where each axis' next cell boundary is crossed
+	vec3 tDelta;		// Ray distance between boundaries along each axis
+
+	// Axis whose boundary is crossed first
+	int nextAxis() const { return tNext.x < tNext.y ? (tNext.x < tNext.z ? 0 : 2) : (tNext.y < tNext.z ? 1 : 2); }
+	// Step to the next cell, return false when the ray leaves the grid
+	bool advance(int axis) {
+		cell[axis] += step[axis];
+		if (cell[axis] == out[axis])
+			return false;
+		tNext[axis] += tDelta[axis];
+		return true;
+	}
+};
+
+// Start a walk in the cell where the ray enters the grid, return false if it misses the grid
+static bool startWalk(const UniformGrid& grid, const Ray& ray, float tMax, CellWalk& walk) {
+	vec3 invDir = 1.0f / ray.dir;	// Zero components become infinities
+	float tEnter = intersectBox(ray.orig, invDir, grid.minBB, grid.maxBB, tMax);
+	if (tEnter == FLT_MAX)
+		return false;
+
+	vec3 invCellSize = vec3(grid.res) / (grid.maxBB - grid.minBB);
+	walk.cell = glm::clamp(ivec3((ray.orig + tEnter * ray.dir - grid.minBB) * invCellSize), ivec3(0), grid.res - 1);
+	for (int axis = 0; axis < 3; axis++) {
+		if (ray.dir[axis] > 0.0f) {
+			walk.step[axis] = 1;
+			walk.out[axis] = grid.res[axis];
+			walk.tNext[axis] = (grid.minBB[axis] + (walk.cell[axis] + 1) * grid.cellSize[axis] - ray.orig[axis]) * invDir[axis];
+			walk.tDelta[axis] = grid.cellSize[axis] * invDir[axis];
+		} else if (ray.dir[axis] < 0.0f) {
+			walk.step[axis] = -1;
+			walk.out[axis] = -1;
+			walk.tNext[axis] = (grid.minBB[axis] + walk.cell[axis] * grid.cellSize[axis] - ray.orig[axis]) * invDir[axis];
+			walk.tDelta[axis] = -grid.cellSize[axis] * invDir[axis];
+		} else {
+			walk.step[axis] = 0;
+			walk.out[axis] = -1;
+			walk.tNext[axis] = FLT_MAX;
+			walk.tDelta[axis] = 0.0f;
+		}
+	}
+	return true;
+}
+
+bool UniformGrid::intersectCloser(const Ray& ray, float& tHit, unsigned int& triIdx) const {
+	bool hit = tHit != FLT_MAX;
+	if (empty())
+		return hit;
+	const float ROUNDING = 1.0f + 4.0f * FLT_EPSILON;	// Same widening as intersectBox
+	// Start in the cell where the ray enters the grid
+	CellWalk walk;
+	if (!startWalk(*this, ray, FLT_MAX, walk))
+		return hit;
+
+	unsigned int mailbox[MAILBOX_SIZE];
+	for (int i = 0; i < MAILBOX_SIZE; i++)
+		mailbox[i] = ~0u;
+	while (true) {
+		// Test the triangles of this cell that were not tested yet, a batch at a time
+		unsigned int c = walk.cell.x + res.x * (walk.cell.y + res.y * walk.cell.z);
+		unsigned int batch[BATCH_SIZE];
+		unsigned int batchCount = 0;
+		for (unsigned int i = cellStart[c]; i < cellStart[c + 1]; i++) {
+			unsigned int tri = cellTris[i];
+			if (mailbox[tri % MAILBOX_SIZE] == tri)
+				continue;
+			mailbox[tri % MAILBOX_SIZE] = tri;
+			batch[batchCount++] = tri;
+			if (batchCount == BATCH_SIZE) {
+				if (tris->intersect(ray, batch, batchCount, tHit, triIdx))
+					hit = true;
+				batchCount = 0;
+			}
+		}
+		if (batchCount > 0 && tris->intersect(ray, batch, batchCount, tHit, triIdx))
+			hit = true;
+
+		// Step to the next cell, unless the closest hit lies before it
+		int axis = walk.nextAxis();
+		if (hit && tHit <= walk.tNext[axis] * ROUNDING)
+			break;
+		if (!walk.advance(axis))
+			break;
+	}
+
+	return hit;
+}
+
+bool UniformGrid::occluded(const Ray& ray, float tMin, float tMax) const {
+	if (empty())
+		return false;
+	const float ROUNDING = 1.0f + 4.0f * FLT_EPSILON;	// Same widening as intersectBox
+	CellWalk walk;
+	if (!startWalk(*this, ray, tMax, walk))
+		return false;
+
+	// Any hit within the range ends the walk, wherever it lies, so cells need no hit ordering
+	unsigned int mailbox[MAILBOX_SIZE];
+	for (int i = 0; i < MAILBOX_SIZE; i++)
+		mailbox[i] = ~0u;
+	while (true) {
+		unsigned int c = walk.cell.x + res.x * (walk.cell.y + res.y * walk.cell.z);
+		unsigned int batch[BATCH_SIZE];
+		unsigned int batchCount = 0;
+		for (unsigned int i = cellStart[c]; i < cellStart[c + 1]; i++) {
+			unsigned int tri = cellTris[i];
+			if (mailbox[tri % MAILBOX_SIZE] == tri)
+				continue;
+			mailbox[tri % MAILBOX_SIZE] = tri;
+			batch[batchCount++] = tri;
+			if (batchCount == BATCH_SIZE) {
+				if (tris->occluded(ray, batch, batchCount, tMin, tMax))
+					return true;
+				batchCount = 0;
+			}
+		}
+		if (batchCount > 0 && tris->occluded(ray, batch, batchCount, tMin, tMax))
+			return true;
+
+		// Stop once the next cell starts beyond tMax
+		int axis = walk.nextAxis();
+		if (walk.tNext[axis] > tMax * ROUNDING || !walk.advance(axis))
+			return false;
+	}
+}
+
+size_t UniformGrid::memoryUsage() const {
+	return (cellStart.size() + cellTris.size()) * sizeof(unsigned int);
+}
+
+bool UniformGrid::preferred(const vector<Mesh::Vtx>& verts) {
+	unsigned int triCount = verts.size() / 3;
+	if (triCount < GRID_MIN_TRIS)
+		return false;
+
+	// Count triangle boxes per cell of a coarse grid
+	vec3 lo(FLT_MAX), hi(-FLT_MAX);
+	for (unsigned int i = 0; i < verts.size(); i++) {
+		lo = glm::min(lo, verts[i].pos);
+		hi = glm::max(hi, verts[i].pos);
+	}
+	ivec3 fillRes(FILL_RES);
+	vec3 invCellSize = vec3(fillRes) / glm::max(hi - lo, vec3(FLT_MIN));
+	vector<unsigned int> counts(FILL_RES * FILL_RES * FILL_RES, 0);
+	for (unsigned int i = 0; i < triCount; i++) {
+		vec3 triLo = glm::min(verts[3 * i].pos, glm::min(verts[3 * i + 1].pos, verts[3 * i + 2].pos));
+		vec3 triHi = glm::max(verts[3 * i].pos, glm::max(verts[3 * i + 1].pos, verts[3 * i + 2].pos));
+		ivec3 first, last;
+		cellRange(triLo, triHi, lo, invCellSize, fillRes, first, last);
+		for (int z = first.z; z <= last.z; z++)
+			for (int y = first.y; y <= last.y; y++)
+				for (int x = first.x; x <= last.x; x++)
+					counts[x + FILL_RES * (y + FILL_RES * z)]++;
+	}
+
+	// The box must be well filled, and the occupied cells evenly loaded
+	unsigned int occupied = 0;
+	double sum = 0.0, sumSq = 0.0;
+	for (unsigned int c = 0; c < counts.size(); c++) {
+		if (counts[c] == 0)
+			continue;
+		occupied++;
+		sum += counts[c];
+		sumSq += (double)counts[c] * counts[c];
+	}
+	float fill = (float)occupied / counts.size();
+	double mean = sum / occupied;
+	double variation = sqrt(std::max(0.0, sumSq / occupied - mean * mean)) / mean;
+	return fill >= GRID_MIN_FILL && variation <= GRID_MAX_VARIATION;
+}
@@ -0,0 +1,47 @@
+#ifndef GRID_HPP
+#define GRID_HPP
+
+#include <vector>
+#include <glm/glm.hpp>
+#include "mesh.hpp"
+#include "ray.hpp"
+#include "tristore.hpp"
+#include "accel.hpp"
+
+// Uniform grid over a triangle list, traversed with a 3D-DDA
+// Builds in linear time, which suits dense meshes whose triangles spread evenly over their box
+class UniformGrid : public Accel {
+public:
+	UniformGrid();
+
+	// Build over the triangles of a store
+	// The store is referenced, not copied, and must outlive the grid
+	void build(const TriangleStore& tris);
+	void clear();
+	bool empty() const { return cellStart.empty(); }
+
+	// Closest hit nearer than the one tHit and triIdx already hold, see Accel
+	bool intersectCloser(const Ray& ray, float& tHit, unsigned int& triIdx) const;
+	using Accel::intersect;
+	// Whether anything is hit within [tMin, tMax], stopping at the first hit found
+	bool occluded(const Ray& ray, float tMin, float tMax) const;
+	using Accel::occluded;
+	size_t memoryUsage() const;
+	const TriangleStore& triangles() const { return *tris; }
+
+	// Whether a grid should trace this triangle list rather than a hierarchy,
+	// decided from the triangle count and how much of the bounding box the triangles fill
+	static bool preferred(const std::vector<Mesh::Vtx>& verts);
+
+	// Grid data, cell (x, y, z) lists cellTris[cellStart[c], cellStart[c + 1]) with c = x + res.x * (y + res.y * z)
+	glm::ivec3 res;
+	glm::vec3 minBB, maxBB;
+	glm::vec3 cellSize;
+	std::vector<unsigned int> cellStart;
+	std::vector<unsigned int> cellTris;
+
+protected:
+	const TriangleStore* tris;	// Triangles the grid was built over
+};
+
+#endif
@@ -0,0 +1,218 @@
+#include "bvh.hpp"
+#include "parallel.hpp"
+#include "radixsort.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cfloat>
+#include <memory>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+using namespace std;
+using namespace glm;
+
+// Build parameters
+const int MORTON_BITS = 10;				// Quantization of each centroid axis, 30-bit codes
+const float SAH_TRAVERSAL_COST = 1.0f;	// Cost model of the binned build, decides which subtrees collapse
+
+// Surface area of a box (half of it, the factor cancels out in the heuristic)
+static float halfArea(const vec3& minBB, const vec3& maxBB) {
+	vec3 e = maxBB - minBB;
+	return e.x * e.y + e.y * e.z + e.z * e.x;
+}
+
+static int leadingZeros(unsigned int x) {
+#ifdef _MSC_VER
+	unsigned long bit;
+	return _BitScanReverse(&bit, x) ? 31 - (int)bit : 32;
+#else
+	return x ? __builtin_clz(x) : 32;
+#endif
+}
+
+// Center of a triangle's box
+static vec3 triangleCentroid(const Mesh::Vtx* tri) {
+	return (glm::min(tri[0].pos, glm::min(tri[1].pos, tri[2].pos)) +
+		glm::max(tri[0].pos, glm::max(tri[1].pos, tri[2].pos))) * 0.5f;
+}
+
+void BVH::buildLinear(const TriangleStore& tris, bool optimize) {
+	unsigned int triCount = tris.size();
+	if (triCount < 2) {
+		build(tris);
+		return;
+	}
+	clear();
+	this->tris = &tris;
+	const vector<Mesh::Vtx>& verts = tris.vertices();
+
+	// Centroid bounds the codes are quantized in
+	unsigned int workers = workerCount(triCount);
+	vector<vec3> sliceMin(workers), sliceMax(workers);
+	runWorkers(workers, [&](unsigned int w) {
+		vec3 minC(FLT_MAX), maxC(-FLT_MAX);
+		for (unsigned int i = sliceBegin(triCount, w, workers); i < sliceBegin(triCount, w + 1, workers); i++) {
+			vec3 centroid = triangleCentroid(&verts[3 * i]);
+			minC = glm::min(minC, centroid);
+			maxC = glm::max(maxC, centroid);
+		}
+		sliceMin[w] = minC;
+		sliceMax[w] = maxC;
+	});
+	vec3 minC(FLT_MAX), maxC(-FLT_MAX);
+	for (unsigned int w = 0; w < workers; w++) {
+		minC = glm::min(minC, sliceMin[w]);
+		maxC = glm::max(maxC, sliceMax[w]);
+	}
+
+	// Interleave the quantized centroid coordinates into Morton codes and sort along them
+	const int cells = 1 << MORTON_BITS;
+	vec3 extent = maxC - minC;
+	vec3 scale(extent.x > 0.0f ? cells / extent.x : 0.0f, extent.y > 0.0f ? cells / extent.y : 0.0f,
+		extent.z > 0.0f ? cells / extent.z : 0.0f);
+	vector<unsigned int> codes(triCount);
+	triIndices.resize(triCount);
+	parallelFor(triCount, [&](unsigned int first, unsigned int last) {
+		for (unsigned int i = first; i < last; i++) {
+			ivec3 q = glm::clamp(ivec3((triangleCentroid(&verts[3 * i]) - minC) * scale), ivec3(0), ivec3(cells - 1));
+			codes[i] = (expandBits(q.x) << 2) | (expandBits(q.y) << 1) | expandBits(q.z);
+			triIndices[i] = i;
+		}
+	});
+	radixSort(codes, triIndices, 3 * MORTON_BITS);
+
+	// Radix tree over the sorted codes (Karras 2012), every interior node is found on its own:
+	// ids below innerCount are interior nodes, id innerCount + k is the leaf of sorted triangle k,
+	// and interior node i covers the sorted range that starts or ends at i
+	unsigned int innerCount = triCount - 1;
+	const unsigned int NO_PARENT = ~0u;
+	struct BuildNode {
+		vec3 minBB;
+		float cost;				// SAH cost of the subtree, relative to one triangle test
+		vec3 maxBB;
+		unsigned int parent;
+	};
+	// Scratch arrays are filled completely below, so they are left uninitialized
+	unique_ptr<BuildNode[]> tree(new BuildNode[innerCount + triCount]);
+	unique_ptr<unsigned int[]> children(new unsigned int[2 * innerCount]);
+	unique_ptr<unsigned int[]> rangeFirst(new unsigned int[innerCount]), rangeLast(new unsigned int[innerCount]);
+	tree[0].parent = NO_PARENT;
+	parallelFor(innerCount, [&](unsigned int first, unsigned int last) {
+		// Length of the common prefix of two codes, duplicates are told apart by their position
+		auto prefix = [&](int a, int b) -> int {
+			if (b < 0 || b >= (int)triCount)
+				return -1;
+			if (codes[a] == codes[b])
+				return 32 + leadingZeros((unsigned int)a ^ (unsigned int)b);
+			return leadingZeros(codes[a] ^ codes[b]);
+		};
+		for (int i = first; i < (int)last; i++) {
+			// The range extends toward the neighbor sharing the longer prefix
+			int d = prefix(i, i + 1) > prefix(i, i - 1) ? 1 : -1;
+			int minPrefix = prefix(i, i - d);
+			int maxLength = 2;
+			while (prefix(i, i + maxLength * d) > minPrefix)
+				maxLength *= 2;
+			int length = 0;
+			for (int step = maxLength / 2; step >= 1; step /= 2)
+				if (prefix(i, i + (length + step) * d) > minPrefix)
+					length += step;
+			int j = i + length * d;
+
+			// Split where the prefix of the whole range ends
+			int nodePrefix = prefix(i, j);
+			int split = 0, step = length;
+			do {
+				step = (step + 1) / 2;
+				if (prefix(i, i + (split + step) * d) > nodePrefix)
+					split += step;
+			} while (step > 1);
+			int gamma = i + split * d + std::min(d, 0);
+
+			unsigned int lo = std::min(i, j), hi = std::max(i, j);
+			unsigned int left = lo == (unsigned int)gamma ? innerCount + gamma : gamma;
+			unsigned int right = hi == (unsigned int)gamma + 1 ? innerCount + gamma + 1 : gamma + 1;
+			children[2 * i] = left;
+			children[2 * i + 1] = right;
+			tree[left].parent = i;
+			tree[right].parent = i;
+			rangeFirst[i] = lo;
+			rangeLast[i] = hi;
+		}
+	});
+
+	// Bottom-up from the leaves: fit boxes and SAH costs, the child that finishes second
+	// continues into the parent, so every node is fitted once after both of its children
+	// Also count the nodes each subtree will be laid out as
+	vector<unsigned char> collapse(innerCount);
+	unique_ptr<unsigned int[]> subtreeNodes(new unsigned int[innerCount]);
+	unique_ptr<atomic<unsigned int>[]> arrivals(new atomic<unsigned int>[innerCount]);
+	for (unsigned int i = 0; i < innerCount; i++)
+		arrivals[i].store(0, memory_order_relaxed);
+	parallelFor(triCount, [&](unsigned int first, unsigned int last) {
+		for (unsigned int k = first; k < last; k++) {
+			BuildNode& leaf = tree[innerCount + k];
+			const Mesh::Vtx* tri = &verts[3 * triIndices[k]];
+			leaf.minBB = glm::min(tri[0].pos, glm::min(tri[1].pos, tri[2].pos));
+			leaf.maxBB = glm::max(tri[0].pos, glm::max(tri[1].pos, tri[2].pos));
+			leaf.cost = 1.0f;
+			for (unsigned int idx = leaf.parent; idx != NO_PARENT; idx = tree[idx].parent) {
+				if (arrivals[idx].fetch_add(1, memory_order_acq_rel) == 0)
+					break;
+				BuildNode& node = tree[idx];
+				const BuildNode& left = tree[children[2 * idx]];
+				const BuildNode& right = tree[children[2 * idx + 1]];
+				node.minBB = glm::min(left.minBB, right.minBB);
+				node.maxBB = glm::max(left.maxBB, right.maxBB);
+				// Same leaf rule as the binned build
+				unsigned int count = rangeLast[idx] - rangeFirst[idx] + 1;
+				float area = halfArea(node.minBB, node.maxBB);
+				float splitCost = SAH_TRAVERSAL_COST + (area > 0.0f ?
+					(halfArea(left.minBB, left.maxBB) * left.cost + halfArea(right.minBB, right.maxBB) * right.cost) / area : 0.0f);
+				collapse[idx] = optimize && count <= MAX_LEAF_TRIS && splitCost >= count;
+				node.cost = collapse[idx] ? count : splitCost;
+				unsigned int leftNodes = children[2 * idx] < innerCount ? subtreeNodes[children[2 * idx]] : 1;
+				unsigned int rightNodes = children[2 * idx + 1] < innerCount ? subtreeNodes[children[2 * idx + 1]] : 1;
+				subtreeNodes[idx] = collapse[idx] ? 1 : 1 + leftNodes + rightNodes;
+			}
+		}
+	});
+
+	// Lay the tree out depth-first with siblings next to each other, collapsed subtrees and
+	// subtrees at the depth limit become leaves over their sorted range
+	struct Item {
+		unsigned int id, nodeIdx;
+		int depth;
+	};
+	nodes.reserve(subtreeNodes[0]);
+	nodes.resize(1);
+	vector<Item> stack;
+	Item root = { 0, 0, 0 };
+	stack.push_back(root);
+	while (!stack.empty()) {
+		Item item = stack.back();
+		stack.pop_back();
+		Node& node = nodes[item.nodeIdx];
+		node.minBB = tree[item.id].minBB;
+		node.maxBB = tree[item.id].maxBB;
+		if (item.id >= innerCount) {
+			node.leftFirst = item.id - innerCount;
+			node.triCount = 1;
+			continue;
+		}
+		if (collapse[item.id] || item.depth >= MAX_DEPTH) {
+			node.leftFirst = rangeFirst[item.id];
+			node.triCount = rangeLast[item.id] - rangeFirst[item.id] + 1;
+			continue;
+		}
+		unsigned int leftIdx = nodes.size();
+		node.leftFirst = leftIdx;
+		node.triCount = 0;
+		nodes.resize(leftIdx + 2);
+		Item right = { children[2 * item.id + 1], leftIdx + 1, item.depth + 1 };
+		Item left = { children[2 * item.id], leftIdx, item.depth + 1 };
+		stack.push_back(right);
+		stack.push_back(left);
+	}
+	leafTris.build(verts, triIndices);
+}
@@ -1,5 +1,9 @@
 #include <iostream>
+#include <iomanip>
+#include <chrono>
 #include <cassert>
+#include <cfloat>
+#include <memory>
 #include <random>
 #include <glm/glm.hpp>
 #include <glm/gtc/type_ptr.hpp>
@@ -9,25 +13,34 @@
 #include <GL/freeglut.h>
 #include "util.hpp"
 #include "mesh.hpp"
+#include "ray.hpp"
+#include "tristore.hpp"
+#include "bvh.hpp"
+#include "bvh4.hpp"
+#include "qbvh4.hpp"
+#include "grid.hpp"
+#include "scene.hpp"
+#include "mappedfile.hpp"
+#include "tilebin.hpp"
+#include "raysort.hpp"
+#include "glccamera.hpp"
 using namespace std;
 using namespace glm;
 
 // Mesh vertex format
-struct Vtx {
-	vec3 pos;		// Position
-	vec3 norm;		// Normal
-};
-
-// Ray vertex format
-struct Ray {
-	vec3 orig;
-	vec3 dir;
-};
+typedef Mesh::Vtx Vtx;
 
 // Global state
 GLint width, height;			// Window size
 GLuint texWidth, texHeight;		// Texture size
 vector<glm::u8vec3> texData;	// Texture pixel data
+vector<Ray> rayBuffer;			// Rays of the current frame, traced in bulk
+vector<unsigned int> rayPixels;	// Pixel of each ray of rayBuffer
+GLCCamera rayCamera;			// Camera, transform and order rayBuffer was generated for, while raysValid
+mat4 rayXform;
+bool rayBlocks;
+bool raysValid;
+vector<Hit> hitBuffer;			// Closest hit of each ray of rayBuffer, shaded once the whole frame is traced
 GLuint texture;			// Texture object
 GLuint shader;			// Shader program
 GLuint uniXform;		// Shader location of xform mtx
@@ -42,13 +55,36 @@ std::mt19937 rng;		// Random number generator
 bool drawing;			// Whether we are drawing
 glm::u8vec3 drawColor;	// What color to draw in
 Mesh* mesh;
-vector<Vtx> objVerts;
+vector<Vtx> objVerts;	// Object space triangles of the loaded mesh
+TriangleStore objTris;	// objVerts prepared for ray tests
+string objFile;			// Model file objVerts was loaded from
+BVH bvh;				// Hierarchy over objVerts
+BVH4 bvh4;				// 4-wide hierarchy collapsed from bvh
+QBVH4 qbvh4;			// Quantized copy of bvh4
+UniformGrid grid;		// Grid over objVerts
+Accel* accel;			// Structure used for tracing
+bool useQuantizedBVH;	// Trace through qbvh4 instead of bvh4
+bool usePackets;		// Trace 8x8 pixel blocks as ray packets through bvh, blocks too wide for a packet go ray by ray
+bool useLinearBuild;	// Build bvh with the parallel linear builder instead of the SAH build and its cache
+bool cullBackFaces;		// Skip bvh4 subtrees whose triangles all face away from the ray
+bool gridPreferred;		// Whether the heuristic picked the grid for the loaded mesh
+Scene scene;			// Instanced scene, built the first time it is chosen
+TileBins tileBins;		// Screen tiles of objVerts for the current frame
+mat4 objToWorld;		// Object transform (translate/rotate, then push back along -z)
+mat4 worldToObj;		// Inverse object transform, applied to every ray
 vector<vec3> orthogonalVerts; // relative to +z axis direction
 vector<vec3> perspectiveVerts;
 vector<vec3> pushbroomVerts;
+vector<vec3> crossSlitVerts;
+vector<vec3> pencilVerts;
+vector<vec3> twistedOrthogonalVerts;
+vector<vec3> bilinearVerts;
 vector<vec3> imagePlaneVerts;
-int objType;			// 7:cube 8:teapot 9:3d_triangle 10:teapot_less
-int glcType;			// 4:perspective 5:orthogonal 6:pushbroom
+int objType;			// 7:cube 8:teapot 9:3d_triangle 10:teapot_less 11:cow 14:instances
+int loadedObjType;		// objType of the current mesh, 0 if none is loaded
+int glcType;			// 4:perspective 5:orthogonal 6:pushbroom 19:cross-slit 20:pencil 21:twisted orthogonal 22:bilinear
+GLCCamera camera;		// Camera of glcType, set when the type changes
+int cameraType;			// glcType the camera was set for, 0 before the first frame
 float transX;
 float transY;
 float transZ;
@@ -62,10 +98,27 @@ const int MENU_EXIT = 3;			// Exit application
 const int GLC_PERSPECTIVE = 4;			// Perspective GLC
 const int GLC_ORTHOGONAL = 5;			// Perspective GLC
 const int GLC_PUSHBROOM = 6;
+const int GLC_CROSS_SLIT = 19;		// Rays through two skew slits
+const int GLC_PENCIL = 20;			// Rays through one slit, in planes fanning around it
+const int GLC_TWISTED_ORTHOGONAL = 21;	// Rays parallel to one plane, twisting from plane to plane
+const int GLC_BILINEAR = 22;		// Rays through no common line
 const int OBJ_CUBE = 7;
-//const int OBJ_TEAPOT = 8;
+const int OBJ_TEAPOT = 8;
 const int OBJ_3DTRIANGLE = 9;
 const int OBJ_TEAPOT_LESS = 10;
+const int OBJ_COW = 11;
+const int MENU_QUANTIZED_BVH = 12;	// Toggle the quantized node format
+const int MENU_ACCEL_REPORT = 13;	// Print footprint and speed of each structure
+const int OBJ_INSTANCES = 14;		// Grid of instances sharing a few meshes
+const int SCENE_GRID = 16;			// Instances per row and column of the instanced scene
+const float SCENE_SPACING = 0.3f;	// Distance between neighboring instances
+const float TILE_MAX_LIST = 4.0f;	// Screen tiles replace the 3D structure up to this many triangles per tile
+const int MENU_PACKETS = 15;		// Toggle ray packet tracing
+const int PACKET_SIZE = 8;			// Ray packets cover PACKET_SIZE x PACKET_SIZE pixels
+const int MENU_LINEAR_BUILD = 16;	// Toggle the linear BVH builder
+const int MENU_TRI_KERNEL = 17;		// Switch to the next SIMD triangle kernel the CPU supports
+const int MENU_BACKFACE_CULLING = 18;	// Toggle back-face culling of bvh4 subtrees
+const int AO_RAYS = 4;				// Ambient occlusion rays per primary hit in the structure report
 
 // Initialization functions
 void initState();
@@ -87,6 +140,7 @@ void keyboard(unsigned char key, int x, int y);
 
 //Util functions
 glm::u8vec3 randColor();
+Accel* selectAccel();
 
 int main(int argc, char** argv) {
 	try {
@@ -124,6 +178,11 @@ void initState() {
 	texHeight = 256;
 	bgColor = u8vec3(255, 255, 255);
 	texData.resize(texWidth * texHeight, bgColor);
+	rayBuffer.resize(texWidth * texHeight);
+	rayPixels.resize(texWidth * texHeight);
+	hitBuffer.resize(texWidth * texHeight);
+	rayBlocks = false;
+	raysValid = false;
 	texture = 0;
 	shader = 0;
 	uniXform = 0;
@@ -132,8 +191,16 @@ void initState() {
 	ibuf = 0;
 	vcount = 0;
 	mesh = NULL;
+	accel = NULL;
+	useQuantizedBVH = false;
+	usePackets = false;
+	useLinearBuild = false;
+	cullBackFaces = false;
+	gridPreferred = false;
 	objType = OBJ_CUBE;
+	loadedObjType = 0;
 	glcType = GLC_PERSPECTIVE;
+	cameraType = 0;
 	transX = 0.f;
 	transY = 0.f;
 	transZ = 0.f;
@@ -161,11 +228,23 @@ void initGLUT(int* argc, char** argv) {
 	glutAddMenuEntry("Perspective View", GLC_PERSPECTIVE);
 	glutAddMenuEntry("Orthogonal View", GLC_ORTHOGONAL);
 	glutAddMenuEntry("PushBroom View", GLC_PUSHBROOM);
+	glutAddMenuEntry("Cross-Slit View", GLC_CROSS_SLIT);
+	glutAddMenuEntry("Pencil View", GLC_PENCIL);
+	glutAddMenuEntry("Twisted Orthogonal View", GLC_TWISTED_ORTHOGONAL);
+	glutAddMenuEntry("Bilinear View", GLC_BILINEAR);
 	glutAddMenuEntry("Cube", OBJ_CUBE);
-	//glutAddMenuEntry("Teapot", OBJ_TEAPOT);
+	glutAddMenuEntry("Teapot", OBJ_TEAPOT);
 	glutAddMenuEntry("3D Triangle", OBJ_3DTRIANGLE);
 	glutAddMenuEntry("Teapot 3d less", OBJ_TEAPOT_LESS);
+	glutAddMenuEntry("Cow", OBJ_COW);
+	glutAddMenuEntry("Instanced scene", OBJ_INSTANCES);
 	glutAddMenuEntry("Change background color", MENU_CHANGE_BG_COLOR);
+	glutAddMenuEntry("Toggle quantized BVH", MENU_QUANTIZED_BVH);
+	glutAddMenuEntry("Toggle ray packets", MENU_PACKETS);
+	glutAddMenuEntry("Toggle linear BVH build", MENU_LINEAR_BUILD);
+	glutAddMenuEntry("Next triangle kernel", MENU_TRI_KERNEL);
+	glutAddMenuEntry("Toggle back-face culling", MENU_BACKFACE_CULLING);
+	glutAddMenuEntry("Acceleration structure report", MENU_ACCEL_REPORT);
 	glutAddMenuEntry("Exit", MENU_EXIT);
 	glutAttachMenu(GLUT_RIGHT_BUTTON);
 
@@ -280,6 +359,35 @@ void initPlaneVerts() {
 		vec3(1.f, 0.f, 0.f)
 	};
 
+	// The other GLCs, with (u, v) = M (s, t) over the image plane triangle below
+	// cross-slit, M = diag(1/2, 1/4): slits x = 0 at z = 2 and y = 0 at z = 4/3
+	crossSlitVerts = {
+		vec3(-0.5f, -0.25f, 1.0f),
+		vec3(0.5f, -0.25f, 1.0f),
+		vec3(0.5f, 0.25f, 1.0f)
+	};
+
+	// pencil, M = (1/2, 1/4; 0, 1/2): the single slit y = 0 at z = 2
+	pencilVerts = {
+		vec3(-0.75f, -0.5f, 1.0f),
+		vec3(0.25f, -0.5f, 1.0f),
+		vec3(0.75f, 0.5f, 1.0f)
+	};
+
+	// twisted orthogonal, M = (1, -1/2; 0, 1): directions (t / 2, 0, -1) turn from row to row
+	twistedOrthogonalVerts = {
+		vec3(-0.5f, -1.0f, 1.0f),
+		vec3(1.5f, -1.0f, 1.0f),
+		vec3(0.5f, 1.0f, 1.0f)
+	};
+
+	// bilinear, M = (1, -1/4; 1/4, 1): directions (t / 4, -s / 4, -1) share no slit
+	bilinearVerts = {
+		vec3(-0.75f, -1.25f, 1.0f),
+		vec3(1.25f, -0.75f, 1.0f),
+		vec3(0.75f, 1.25f, 1.0f)
+	};
+
 	// image place vertor definition
 	imagePlaneVerts = {
 		vec3(-1.0f, -1.0f, 0.0f),
@@ -302,70 +410,11 @@ void drawMesh(Mesh* mesh, mat4 xform) {
 	mesh->draw();
 }
 
-float RayTriangleIntersection(Ray ray, vector<Vtx> triangle) {
-	vec3 norm = triangle[0].norm;
-	vec3 v1 = triangle[0].pos;
-	vec3 v2 = triangle[1].pos;
-	vec3 v3 = triangle[2].pos;
-	float depth = -99999.0;
-
-	// Decide whether the ray can interact with the plane
-	if (fabs(dot(norm, ray.dir)) < 0.001) {
-		// It means ray and triangle plane will not have intersection
-		return depth;
-	}
-	// It has intersection with the plane (not exactly with triangle!)
-	// Get intersection point 
-	float t = dot(v1 - ray.orig, norm) / dot(ray.dir, norm);
-	if (t < 0) {
-		return depth;
-	}
-	vec3 P = ray.orig + t * ray.dir;
-
-	// Decide whether P is inside the triangle
-	// Define 3 edge vector according to counter clockwise
-	vec3 e1 = v2 - v1;
-	vec3 e2 = v3 - v2;
-	vec3 e3 = v1 - v3;
-	// Define 3 vector from P to each vertex coordinate
-	vec3 pp1 = P - v1;
-	vec3 pp2 = P - v2;
-	vec3 pp3 = P - v3;
-	// Use right hand rule: decide whether P is located on the left side of each vector ei
-	// if yes: then P inside the triangle
-	if (dot(cross(e1, pp1), norm) >= 0 &&
-		dot(cross(e2, pp2), norm) >= 0 &&
-		dot(cross(e3, pp3), norm) >= 0) {
-		// return the P's depth
-		depth = P.z;
-	}
-
-	//cout << "depth: " << depth << endl;
-	return depth;
-}
-
-vec3 samplerObjectTriangle(vector<Vtx> triangle) {
-	return triangle[0].norm;
-}
-
-vec3 castRay2Objects(Ray ray, vector<Vtx> vertices) {
-	float minDepth = -99999.0;
-	vec3 norm = vec3(0.0f);
-	for (int i = 0; i < vertices.size(); i += 3) {
-		vector<Vtx> triangle;
-		triangle.push_back(vertices[i+0]);
-		triangle.push_back(vertices[i+1]);
-		triangle.push_back(vertices[i+2]);
-	
-		// !Attention to the Depth +-
-		float depth = RayTriangleIntersection(ray, triangle);
-		if (depth > minDepth) {
-			minDepth = depth;
-			norm = samplerObjectTriangle(triangle);
-		}
-	}
-
-	return norm;
+// World space normal at a hit on the loaded mesh, read from the store for the triangle hit
+vec3 objectNormal(const Hit& hit) {
+	// The transform is rigid (or uniformly scaled), so its linear part carries the normal back to world space
+	// The mesh order store holds triangle triIdx in slot triIdx
+	return mat3(objToWorld) * objTris.normal(hit.triIdx);
 }
 
 u8vec3 generateColor(vec3 norm) {
@@ -379,51 +428,6 @@ u8vec3 generateColor(vec3 norm) {
 	return color;
 }
 
-Ray generateRay(vector<vec3> imagePlaneVerts, vector<vec3> frontPlaneVerts, vec3 texPixelPos) {
-	// Get each coord from defined verts
-	float s1 = imagePlaneVerts[0].x, t1 = imagePlaneVerts[0].y;
-	float s2 = imagePlaneVerts[1].x, t2 = imagePlaneVerts[1].y;
-	float s3 = imagePlaneVerts[2].x, t3 = imagePlaneVerts[2].y;
-	float si = texPixelPos.x, ti = texPixelPos.y;
-	vec2 sti(texPixelPos);
-	vec2 uv1(frontPlaneVerts[0]);
-	vec2 uv2(frontPlaneVerts[1]);
-	vec2 uv3(frontPlaneVerts[2]);
-	
-	// GLC formula calculation
-	float demo_alpha = s1 * t2 + s2 * t3 + s3 * t1 - s3 * t2 - s1 * t3 - s2 * t1;
-	float demo_beta = s2 * t1 + s1 * t3 + s3 * t2 - s3 * t1 - s2 * t3 - s1 * t2;
-	float alpha = (si * t2 + s2 * t3 + s3 * ti - si * t3 - s3 * t2 - s2 * ti) / demo_alpha;
-	float beta = (si * t1 + s3 * ti + s1 * t3 - si * t3 - s1 * ti - s3 * t1) / demo_beta;
-	vec2 uvi = alpha * uv1 + beta * uv2 + (1 - alpha - beta) * uv3;
-
-	vec3 orig = vec3(uvi, 1.0f);
-	vec3 dir = vec3(sti - uvi, -1.0f);
-	Ray ray = {
-		orig,
-		dir
-	};
-	//cout << "----------------" << endl;
-	//cout << ray.orig.x << ", " << ray.orig.y << ", " << ray.orig.z << endl;
-	//cout << ray.dir.x << ", " << ray.dir.y << ", " << ray.dir.z << endl;
-	//cout << "----------------" << endl;
-	return ray;
-}
-
-vec3 texData2WorldCoords(int idx, int texW, int texH, int clipW, int clipH) {
-	// From index to s,t
-	int s = idx % texW;
-	int t = idx / texW;
-	// Translate
-	s = s - 0.5 * texW;  // + 0.5;
-	t = t - 0.5 * texH;  //+ 0.5;
-	// Scale
-	float ss = s * ((float)clipW / texW);
-	float tt = t * ((float)clipH / texH);
-	
-	return vec3(ss, tt, 0.0f);
-}
-
 // Change the color of the texture pixel at the given mouse coordinates
 void drawPoint(glm::ivec2 texPos, glm::u8vec3 color) {
 	if (texPos.x >= 0 && texPos.x < texWidth && texPos.y >= 0 && texPos.y < texHeight) {
@@ -449,61 +453,347 @@ glm::u8vec3 randColor() {
 	return color;
 }
 
-void GLCRender(vector<vec3> uvPlaneVerts, vector<Vtx> objVerts, vector<u8vec3>texData) {
-
-	for (int i = 0; i < texData.size(); i++) {
-		vec3 curPixelPos = texData2WorldCoords(i, texWidth, texHeight, 5, 5);
-		//cout << curPixelPos.x << ", " << curPixelPos.y << endl;
-		Ray ray = generateRay(imagePlaneVerts, uvPlaneVerts, curPixelPos);
-		vec3 norm = castRay2Objects(ray, objVerts);
-		
-		if (norm.x == 0 && norm.y == 0 && norm.z == 0) {
-			// No intersection
-			texData[i] = bgColor;
-		}
-		else {
-			// Has intersection
-			u8vec3 color = generateColor(norm);
-			texData[i] = color;
+// Fill rayBuffer with the object space ray of every pixel, the transform is affine so t is the same
+// in both spaces. The rays follow the rows, or with blocks set, one PACKET_SIZE x PACKET_SIZE block after another
+// Frames that change neither the camera nor the object transform keep the rays of the previous one
+void generateObjectRays(const GLCCamera& camera, bool blocks) {
+	if (raysValid && blocks == rayBlocks && worldToObj == rayXform && camera == rayCamera)
+		return;
+	rayCamera = camera;
+	rayXform = worldToObj;
+	rayBlocks = blocks;
+	raysValid = true;
+
+	int blockW = blocks ? PACKET_SIZE : texWidth, blockH = blocks ? PACKET_SIZE : texHeight;
+	unsigned int k = 0;
+	for (int by = 0; by < texHeight; by += blockH) {
+		for (int bx = 0; bx < texWidth; bx += blockW) {
+			for (int y = by; y < glm::min(by + blockH, (int)texHeight); y++) {
+				// The row of the block is one run of constant steps
+				int count = glm::min(blockW, (int)texWidth - bx);
+				camera.scanline(bx, y, count, worldToObj, &rayBuffer[k]);
+				for (int x = bx; x < bx + count; x++, k++)
+					rayPixels[k] = y * texWidth + x;
+			}
 		}
+	}
+}
 
-		glBindTexture(GL_TEXTURE_2D, texture);
-		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, texWidth, texHeight, GL_RGB, GL_UNSIGNED_BYTE, texData.data());
-		glBindTexture(GL_TEXTURE_2D, 0);
+// Shade every pixel once from its hit in hitBuffer with the normal shade returns for it,
+// then upload the finished image
+template <class Shade>
+void shadeHits(Shade shade, vector<u8vec3>& texData) {
+	for (int k = 0; k < hitBuffer.size(); k++) {
+		const Hit& hit = hitBuffer[k];
+		texData[rayPixels[k]] = hit.valid() ? generateColor(shade(hit)) : bgColor;
+	}
+
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, texWidth, texHeight, GL_RGB, GL_UNSIGNED_BYTE, texData.data());
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+// Shade the pixels whose ray hits anything as facing the camera, without looking for the closest hits
+void GLCRenderVisibility(const GLCCamera& camera, const Accel& accel, vector<u8vec3>& texData) {
+	generateObjectRays(camera, false);
+	u8vec3 facing = generateColor(vec3(0.0f, 0.0f, 1.0f));
+
+	// Any hit answers the query, the answers come back a chunk of rays at a time
+	const unsigned int CHUNK = 4096;
+	bool blocked[CHUNK];
+	for (unsigned int first = 0; first < rayBuffer.size(); first += CHUNK) {
+		unsigned int count = glm::min(CHUNK, (unsigned int)rayBuffer.size() - first);
+		accel.occluded(&rayBuffer[first], count, 0.0f, FLT_MAX, blocked);
+		for (unsigned int k = 0; k < count; k++)
+			texData[rayPixels[first + k]] = blocked[k] ? facing : bgColor;
+	}
+
+	// Upload the finished image once
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, texWidth, texHeight, GL_RGB, GL_UNSIGNED_BYTE, texData.data());
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+// Trace the pixels tile by tile, each ray only tests the triangles binned into its tile
+void GLCRenderTiles(const GLCCamera& camera, const TileBins& bins, vector<u8vec3>& texData) {
+	// Hits land at their pixel, which leaves rayPixels out of step with rayBuffer
+	raysValid = false;
+	const int TILE_SIZE = TileBins::TILE_SIZE;
+	for (int ty = 0; ty < bins.tilesY; ty++) {
+		for (int tx = 0; tx < bins.tilesX; tx++) {
+			for (int y = ty * TILE_SIZE; y < glm::min((ty + 1) * TILE_SIZE, (int)texHeight); y++) {
+				for (int x = tx * TILE_SIZE; x < glm::min((tx + 1) * TILE_SIZE, (int)texWidth); x++) {
+					int i = y * texWidth + x;
+					// The tiles' triangles are prepared in world space, so the ray stays there
+					Ray ray = camera.ray(x, y);
+					bins.intersect(x, y, TwoPlaneTriangles::coordinates(ray), hitBuffer[i]);
+					rayPixels[i] = i;
+				}
+			}
+		}
 	}
+	shadeHits(objectNormal, texData);
+}
+
+// Trace the pixels block by block, the hierarchy takes each block's rays as one packet
+void GLCRenderPackets(const GLCCamera& camera, const BVH& bvh, vector<u8vec3>& texData) {
+	generateObjectRays(camera, true);
+	bvh.intersect(rayBuffer.data(), rayBuffer.size(), hitBuffer.data());
+	shadeHits(objectNormal, texData);
+}
+
+// The last-hit cache counters are added to stats when given
+void GLCRender(const GLCCamera& camera, const Accel& accel, vector<u8vec3>& texData, CacheStats* stats = NULL) {
+	generateObjectRays(camera, false);
+	accel.intersect(rayBuffer.data(), rayBuffer.size(), hitBuffer.data(), stats);
+	shadeHits(objectNormal, texData);
+}
+
+void GLCRender(const GLCCamera& camera, const Scene& scene, vector<u8vec3>& texData) {
+	// The whole scene moves with the object transform, each instance then applies its own
+	generateObjectRays(camera, false);
+	scene.intersect(rayBuffer.data(), rayBuffer.size(), hitBuffer.data());
+	shadeHits([&](const Hit& hit) { return mat3(objToWorld) * scene.normal(hit); }, texData);
 }
 
 void loadMesh(Mesh* mesh) {
 	objVerts.clear(); // Mush clear to avoid data overlap
-	vector<vec3> rawVerts = vector<vec3>(mesh->raw_vertices.size());
+	objFile = mesh->sourceFile();
 
-	// Rotate all the vertices
+	// Regenerate the vertices in object space, the object transform is applied to the rays
+	// Only positions are stored, the face normals come from the triangle store when a hit is shaded
+	objVerts = vector<Vtx>(mesh->v_elements.size());
+	for (int i = 0; i < mesh->v_elements.size(); i++)
+		objVerts[i].pos = mesh->raw_vertices[mesh->v_elements[i]];
+	// Every structure tests the rays against this copy
+	objTris.build(objVerts);
+
+	// Drop the structures of the previous mesh, the one picked is built on first use
+	bvh.clear();
+	bvh4.clear();
+	qbvh4.clear();
+	grid.clear();
+	gridPreferred = UniformGrid::preferred(objVerts);
+	accel = NULL;
+}
+
+void buildHierarchy() {
+	if (!bvh.nodes.empty())
+		return;
+
+	if (useLinearBuild) {
+		// Fast enough to rebuild whenever the triangles change, so it is not cached
+		auto start = chrono::steady_clock::now();
+		bvh.buildLinear(objTris);
+		cout << "built linear hierarchy in " <<
+			chrono::duration<double, milli>(chrono::steady_clock::now() - start).count() << " ms" << endl;
+		bvh4.build(bvh, cullBackFaces);
+		qbvh4.build(bvh4);
+		return;
+	}
+
+	// Reuse the hierarchy saved next to the model when the model file is unchanged
+	string cacheFile = objFile + ".bvh";
+	unsigned long long sourceHash = hashFile(objFile);
+	if (bvh.loadCache(cacheFile, sourceHash, objTris)) {
+		cout << "loaded hierarchy from " << cacheFile << endl;
+	} else {
+		bvh.build(objTris);
+		if (bvh.saveCache(cacheFile, sourceHash))
+			cout << "saved hierarchy to " << cacheFile << endl;
+	}
+	bvh4.build(bvh, cullBackFaces);
+	qbvh4.build(bvh4);
+}
+
+Accel* selectAccel() {
+	// The heuristic picks grid or hierarchy, unless the quantized hierarchy was asked for
+	if (gridPreferred && !useQuantizedBVH) {
+		if (grid.empty())
+			grid.build(objTris);
+		return &grid;
+	}
+	buildHierarchy();
+	return useQuantizedBVH ? (Accel*)&qbvh4 : (Accel*)&bvh4;
+}
+
+void loadScene() {
+	if (scene.instanceCount() > 0)
+		return;
+
+	// Unique meshes, each centered and scaled to fit between its neighbors
+	const char* files[] = { "models/teapot_less.obj", "models/bunny.obj", "models/cow.obj" };
+	const int fileCount = sizeof(files) / sizeof(files[0]);
+	mat4 fit[fileCount];
+	for (int f = 0; f < fileCount; f++) {
+		Mesh sceneMesh(files[f]);
+		pair<vec3, vec3> meshBB = sceneMesh.boundingBox();
+		float radius = 0.5f * length(meshBB.second - meshBB.first);
+		fit[f] = scale(mat4(1.f), vec3(0.5f * SCENE_SPACING / radius)) *
+			translate(mat4(1.f), -(meshBB.first + meshBB.second) / 2.0f);
+		scene.addMesh(sceneMesh);
+	}
+
+	// Lay the instances out on a grid facing the camera, each turned at random
+	std::mt19937 layoutRng(1);
+	std::uniform_real_distribution<float> angle(0.f, 360.f);
+	for (int y = 0; y < SCENE_GRID; y++) {
+		for (int x = 0; x < SCENE_GRID; x++) {
+			int meshIdx = (x + y) % fileCount;
+			vec3 pos = SCENE_SPACING * vec3(x - 0.5f * (SCENE_GRID - 1), y - 0.5f * (SCENE_GRID - 1), 0.f);
+			mat4 place = translate(mat4(1.f), pos) *
+				rotate(mat4(1.f), radians(angle(layoutRng)), vec3(0, 1, 0)) *
+				rotate(mat4(1.f), radians(angle(layoutRng)), vec3(1, 0, 0));
+			scene.addInstance(meshIdx, place * fit[meshIdx]);
+		}
+	}
+	scene.build();
+
+	cout << scene.instanceCount() << " instances of " << scene.meshCount() << " meshes use "
+		<< scene.memoryUsage() / 1024 << " KB (" << scene.flattenedMemoryUsage() / 1024
+		<< " KB with a copy per instance)" << endl;
+}
+
+void updateObjXform() {
+	// Rotate and translate the object, then move it in front of the camera
 	mat4 xform = mat4(1.f);
 	mat4 transMat = translate(mat4(1.f), vec3(transX, transY, transZ));
 	mat4 rotateMat = rotate(mat4(1.f), radians(rotateY), vec3(0, 1, 0));
 	mat4 rotateMat2 = rotate(mat4(1.f), radians(rotateX), vec3(1, 0, 0));
-	xform = rotateMat2 * rotateMat * transMat * xform;
-	for (int i = 0; i < mesh->raw_vertices.size(); i++) {
-		vec4 rawVert = vec4(mesh->raw_vertices[i], 1.f);
-		rawVert = xform * rawVert;
-		rawVerts[i] = vec3(rawVert.x, rawVert.y, rawVert.z - 5.0f);
-		//cout << rawVerts[i].x << ", " << rawVerts[i].y << ", " << rawVerts[i].z << endl;
+	mat4 pushBack = translate(mat4(1.f), vec3(0.f, 0.f, -5.f));
+	objToWorld = pushBack * rotateMat2 * rotateMat * transMat * xform;
+	worldToObj = inverse(objToWorld);
+}
+
+// Ambient occlusion rays leaving the primary hits of hitBuffer in random directions above their
+// triangles, an incoherent batch like the secondary rays of a shading pass. Origins are lifted by offset
+void generateOcclusionRays(vector<Ray>& rays, float offset) {
+	std::mt19937 aoRng(1);
+	std::normal_distribution<float> gauss;
+	rays.clear();
+	for (unsigned int k = 0; k < hitBuffer.size(); k++) {
+		const Hit& hit = hitBuffer[k];
+		if (!hit.valid())
+			continue;
+		// Face normal turned toward the side the primary ray came from
+		const Ray& ray = rayBuffer[k];
+		vec3 norm = objTris.normal(hit.triIdx);
+		if (dot(norm, ray.dir) > 0.0f)
+			norm = -norm;
+		vec3 orig = ray.orig + hit.t * ray.dir + offset * norm;
+		for (int i = 0; i < AO_RAYS; i++) {
+			vec3 dir = normalize(vec3(gauss(aoRng), gauss(aoRng), gauss(aoRng)));
+			Ray aoRay = { orig, dot(dir, norm) < 0.0f ? -dir : dir };
+			rays.push_back(aoRay);
+		}
 	}
+}
 
-	// Regenerate the vertices
-	objVerts = vector<Vtx>(mesh->v_elements.size());
-	for (int i = 0; i < mesh->v_elements.size(); i += 3) {
-		// Store positions
-		objVerts[i + 0].pos = rawVerts[mesh->v_elements[i + 0]];
-		objVerts[i + 1].pos = rawVerts[mesh->v_elements[i + 1]];
-		objVerts[i + 2].pos = rawVerts[mesh->v_elements[i + 2]];
-		// Calculate normals
-		vec3 normal = normalize(cross(objVerts[i + 1].pos - objVerts[i + 0].pos,
-			objVerts[i + 2].pos - objVerts[i + 0].pos));
-		objVerts[i + 0].norm = normal;
-		objVerts[i + 1].norm = normal;
-		objVerts[i + 2].norm = normal;
+void accelReport() {
+	// Built-in models, smallest to largest
+	const char* files[] = {
+		"models/cube.obj", "models/3d_triangle.obj", "models/teapot_less.obj", "models/bunny.obj",
+		"models/cow.obj", "models/teapot.obj", "models/dlamp.obj", "models/leaves.obj"
+	};
+	const char* names[] = { "BVH", "BVH4", "QBVH4", "Grid" };
+	Accel* structures[] = { &bvh, &bvh4, &qbvh4, &grid };
+	const int structureCount = 4;
+
+	GLCCamera reportCamera;
+	reportCamera.set(imagePlaneVerts, perspectiveVerts, texWidth, texHeight, 5, 5);
+
+	// The baseline columns trace an unculled bvh4, only the Cull column skips back faces
+	bool culling = cullBackFaces;
+	cullBackFaces = false;
+
+	cout << "Acceleration structure report (" << texWidth << "x" << texHeight << " perspective rays)" << endl;
+	cout << left << setw(24) << "model" << right << setw(7) << "tris";
+	for (int a = 0; a < structureCount; a++)
+		cout << setw(10) << string(names[a]) + " KB" << setw(10) << string(names[a]) + " ms";
+	cout << setw(10) << "Leaf KB" << setw(10) << "Packet ms" << setw(10) << "Occl ms" << setw(10) << "Cull ms" << setw(10) << "Seed %" << setw(10) << "AO ms" << setw(10) << "AO srt ms" << setw(10) << "SAH bld" << setw(10) << "LBVH bld" << setw(7) << "auto" << endl;
+	for (int f = 0; f < sizeof(files) / sizeof(files[0]); f++) {
+		if (mesh) { delete mesh; mesh = NULL; }
+		mesh = new Mesh(files[f]);
+		loadMesh(mesh);
+		buildHierarchy();
+		if (grid.empty())
+			grid.build(objTris);
+
+		// Center the model and scale it to the size of the cube, so every model fills the view
+		pair<vec3, vec3> meshBB = mesh->boundingBox();
+		float radius = 0.5f * length(meshBB.second - meshBB.first);
+		objToWorld = translate(mat4(1.f), vec3(0.f, 0.f, -5.f)) *
+			scale(mat4(1.f), vec3(sqrt(3.f) / radius)) *
+			translate(mat4(1.f), -(meshBB.first + meshBB.second) / 2.0f);
+		worldToObj = inverse(objToWorld);
+
+		cout << left << setw(24) << files[f] << right << setw(7) << objVerts.size() / 3 << fixed << setprecision(1);
+		// Every timed render generates its rays, none of them gets the previous one's rays for free
+		double seedRate = 0.0;
+		for (int a = 0; a < structureCount; a++) {
+			CacheStats cacheStats;
+			raysValid = false;
+			auto start = chrono::steady_clock::now();
+			GLCRender(reportCamera, *structures[a], texData, &cacheStats);
+			double renderMs = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+			cout << setw(10) << structures[a]->memoryUsage() / 1024.0 << setw(10) << renderMs;
+			if (structures[a] == &bvh4 && cacheStats.tested)
+				seedRate = 100.0 * cacheStats.hits / cacheStats.tested;
+		}
+		// Leaf-ordered copy of the triangles BVH and BVH4 test, not part of their KB columns
+		cout << setw(10) << bvh.leafTriangles().memoryUsage() / 1024.0;
+		raysValid = false;
+		auto start = chrono::steady_clock::now();
+		GLCRenderPackets(reportCamera, bvh, texData);
+		cout << setw(10) << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+		// Visibility of every pixel through BVH4, any hit ends a ray
+		raysValid = false;
+		start = chrono::steady_clock::now();
+		GLCRenderVisibility(reportCamera, bvh4, texData);
+		cout << setw(10) << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+		// BVH4 skipping back-facing subtrees, compare with the BVH4 column
+		BVH4 culled;
+		culled.build(bvh, true);
+		raysValid = false;
+		start = chrono::steady_clock::now();
+		GLCRender(reportCamera, culled, texData);
+		cout << setw(10) << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+		// Share of the BVH4 render's rays that hit the triangle of the ray before them
+		cout << setw(10) << seedRate;
+
+		// Ambient occlusion rays from the hits of an unculled BVH4 render, in the order they were spawned,
+		// then reordered by the sorter (sorting time included). The cull pass above may have dropped some
+		GLCRender(reportCamera, bvh4, texData);
+		vector<Ray> aoRays;
+		generateOcclusionRays(aoRays, 1e-4f * radius);
+		unique_ptr<bool[]> blocked(new bool[aoRays.size()]);
+		float aoRadius = 0.25f * radius;
+		start = chrono::steady_clock::now();
+		bvh4.occluded(aoRays.data(), aoRays.size(), 0.0f, aoRadius, blocked.get());
+		cout << setw(10) << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+		RaySorter sorter;
+		start = chrono::steady_clock::now();
+		sorter.occluded(bvh4, aoRays.data(), aoRays.size(), 0.0f, aoRadius, blocked.get());
+		cout << setw(10) << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+		// Build times of both builders, bypassing the cache
+		BVH rebuilt;
+		start = chrono::steady_clock::now();
+		rebuilt.build(objTris);
+		cout << setw(10) << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+		start = chrono::steady_clock::now();
+		rebuilt.buildLinear(objTris);
+		cout << setw(10) << chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+		cout << setw(7) << (gridPreferred ? "Grid" : "BVH4") << endl;
+		cout.unsetf(ios::fixed);
 	}
+
+	// Reload the chosen object on the next frame, which rebuilds bvh4 with the user's culling
+	cullBackFaces = culling;
+	loadedObjType = 0;
 }
 
 void display() {
@@ -526,27 +816,41 @@ void display() {
 		// Send transformation matrix to shader
 		glUniformMatrix4fv(uniXform, 1, GL_FALSE, value_ptr(xform));
 
-		// Load Mesh to get vertex pos and norm
-		switch (objType) {
-		case OBJ_CUBE:
-			mesh = new Mesh("models/cube.obj");
-			cout << "loading cube..." << endl;
-			break;
-		case OBJ_TEAPOT_LESS:
-			mesh = new Mesh("models/teapot_less.obj");
-			cout << "loading teapot in 3d less..." << endl;
-			break;
-		case OBJ_3DTRIANGLE:
-			mesh = new Mesh("models/3d_triangle.obj");
-			cout << "loading 3D triangle..." << endl;
-			break;
-		/*case OBJ_TEAPOT:
-			mesh = new Mesh("models/teapot.obj");
-			cout << "loading teapot..." << endl;
-			break;*/
+		// Load Mesh to get vertex pos and norm, only when a different object was chosen
+		if (objType != loadedObjType) {
+			if (mesh) { delete mesh; mesh = NULL; }
+			switch (objType) {
+			case OBJ_CUBE:
+				mesh = new Mesh("models/cube.obj");
+				cout << "loading cube..." << endl;
+				break;
+			case OBJ_TEAPOT_LESS:
+				mesh = new Mesh("models/teapot_less.obj");
+				cout << "loading teapot in 3d less..." << endl;
+				break;
+			case OBJ_3DTRIANGLE:
+				mesh = new Mesh("models/3d_triangle.obj");
+				cout << "loading 3D triangle..." << endl;
+				break;
+			case OBJ_TEAPOT:
+				mesh = new Mesh("models/teapot.obj");
+				cout << "loading teapot..." << endl;
+				break;
+			case OBJ_COW:
+				mesh = new Mesh("models/cow.obj");
+				cout << "loading cow..." << endl;
+				break;
+			case OBJ_INSTANCES:
+				cout << "loading instanced scene..." << endl;
+				loadScene();
+				break;
+			}
+
+			if (mesh)
+				loadMesh(mesh);
+			loadedObjType = objType;
 		}
-
-		loadMesh(mesh);
+		updateObjXform();
 
 		switch (glcType) {
 		case GLC_PERSPECTIVE:
@@ -560,9 +864,59 @@ void display() {
 		case GLC_PUSHBROOM:
 			GLCVerts = pushbroomVerts;
 			break;
+
+		case GLC_CROSS_SLIT:
+			GLCVerts = crossSlitVerts;
+			break;
+
+		case GLC_PENCIL:
+			GLCVerts = pencilVerts;
+			break;
+
+		case GLC_TWISTED_ORTHOGONAL:
+			GLCVerts = twistedOrthogonalVerts;
+			break;
+
+		case GLC_BILINEAR:
+			GLCVerts = bilinearVerts;
+			break;
+		}
+		if (glcType != cameraType) {
+			camera.set(imagePlaneVerts, GLCVerts, texWidth, texHeight, 5, 5);
+			cout << GLCCamera::typeName(camera.type) << " camera";
+			for (unsigned int k = 0; k < camera.slits.size(); k++) {
+				const GLCCamera::Slit& slit = camera.slits[k];
+				cout << (k == 0 ? ", " : " and ") << (slit.dir == vec3(0.0f) ? "center (" : "slit through (") <<
+					slit.point.x << ", " << slit.point.y << ", " << slit.point.z << ")";
+				if (slit.dir != vec3(0.0f))
+					cout << " along (" << slit.dir.x << ", " << slit.dir.y << ", " << slit.dir.z << ")";
+			}
+			cout << endl;
+			cameraType = glcType;
 		}
 		
-		GLCRender(GLCVerts, objVerts, texData);
+		if (objType == OBJ_INSTANCES) {
+			GLCRender(camera, scene, texData);
+		} else {
+			// Linear GLCs project small meshes into short tile lists, which need no 3D structure
+			bool tiled = false;
+			unsigned int tileCount = ((texWidth + TileBins::TILE_SIZE - 1) / TileBins::TILE_SIZE) *
+				((texHeight + TileBins::TILE_SIZE - 1) / TileBins::TILE_SIZE);
+			if (objVerts.size() / 3 <= TILE_MAX_LIST * tileCount && TileBins::supported(imagePlaneVerts, GLCVerts)) {
+				tileBins.build(imagePlaneVerts, GLCVerts, objTris, objToWorld, texWidth, texHeight, 5, 5);
+				tiled = tileBins.averageListLength() <= TILE_MAX_LIST;
+			}
+			if (tiled) {
+				GLCRenderTiles(camera, tileBins, texData);
+			} else if (usePackets) {
+				buildHierarchy();
+				GLCRenderPackets(camera, bvh, texData);
+			} else {
+				if (!accel)
+					accel = selectAccel();
+				GLCRender(camera, *accel, texData);
+			}
+		}
 
 		// Draw the textured quad
 		glBindVertexArray(vao);
@@ -689,15 +1043,23 @@ void menu(int cmd) {
 		glutPostRedisplay();
 		break;
 
+	case GLC_CROSS_SLIT:
+	case GLC_PENCIL:
+	case GLC_TWISTED_ORTHOGONAL:
+	case GLC_BILINEAR:
+		glcType = cmd;
+		glutPostRedisplay();
+		break;
+
 	case OBJ_CUBE:
 		objType = OBJ_CUBE;
 		glutPostRedisplay();
 		break;
 
-	/*case OBJ_TEAPOT:
+	case OBJ_TEAPOT:
 		objType = OBJ_TEAPOT;
 		glutPostRedisplay();
-		break;*/
+		break;
 
 	case OBJ_TEAPOT_LESS:
 		objType = OBJ_TEAPOT_LESS;
@@ -709,6 +1071,64 @@ void menu(int cmd) {
 		glutPostRedisplay();
 		break;
 
+	case OBJ_COW:
+		objType = OBJ_COW;
+		glutPostRedisplay();
+		break;
+
+	case OBJ_INSTANCES:
+		objType = OBJ_INSTANCES;
+		glutPostRedisplay();
+		break;
+
+	case MENU_QUANTIZED_BVH:
+		useQuantizedBVH = !useQuantizedBVH;
+		accel = selectAccel();
+		cout << (accel == &grid ? "tracing with uniform grid" :
+			useQuantizedBVH ? "tracing with quantized BVH" : "tracing with full-precision BVH") << endl;
+		glutPostRedisplay();
+		break;
+
+	case MENU_PACKETS:
+		usePackets = !usePackets;
+		cout << (usePackets ? "tracing ray packets" : "tracing single rays") << endl;
+		glutPostRedisplay();
+		break;
+
+	case MENU_LINEAR_BUILD:
+		useLinearBuild = !useLinearBuild;
+		cout << (useLinearBuild ? "building hierarchies with the linear builder" :
+			"building hierarchies with the SAH builder") << endl;
+		// Rebuild the hierarchies of the loaded mesh on the next frame
+		bvh.clear();
+		accel = NULL;
+		glutPostRedisplay();
+		break;
+
+	case MENU_TRI_KERNEL: {
+		// Wrap around to SSE, which every x86-64 CPU runs
+		int next = TriangleStore::kernel() + 1;
+		if (next > TriangleStore::KERNEL_AVX512 || !TriangleStore::useKernel((TriangleStore::Kernel)next))
+			TriangleStore::useKernel(TriangleStore::KERNEL_SSE);
+		cout << "testing triangles with the " << TriangleStore::kernelName(TriangleStore::kernel()) << " kernel" << endl;
+		glutPostRedisplay();
+		break;
+	}
+
+	case MENU_BACKFACE_CULLING:
+		cullBackFaces = !cullBackFaces;
+		cout << (cullBackFaces ? "culling back-facing subtrees" : "testing back-facing subtrees") << endl;
+		// Collapse the loaded hierarchy again, with or without cones
+		if (!bvh.nodes.empty())
+			bvh4.build(bvh, cullBackFaces);
+		glutPostRedisplay();
+		break;
+
+	case MENU_ACCEL_REPORT:
+		accelReport();
+		glutPostRedisplay();
+		break;
+
 	case MENU_CHANGE_BG_COLOR:
 		bgColor = randColor();
 		glutPostRedisplay();
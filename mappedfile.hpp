@@ -0,0 +1,38 @@
+#ifndef MAPPEDFILE_HPP
+#define MAPPEDFILE_HPP
+
+#include <string>
+#include <cstddef>
+
+// Read-only memory mapping of a whole file
+class MappedFile {
+public:
+	MappedFile();
+	~MappedFile() { close(); }
+
+	// Map the file, return false if it does not exist, is empty or cannot be mapped
+	bool open(const std::string& filename);
+	void close();
+
+	const unsigned char* data() const { return bytes; }
+	size_t size() const { return length; }
+
+private:
+	const unsigned char* bytes;
+	size_t length;
+#ifdef _WIN32
+	void* file;		// File and mapping handles
+	void* mapping;
+#else
+	int fd;
+#endif
+
+	// Disallow copy
+	MappedFile(const MappedFile& other);
+	MappedFile& operator=(const MappedFile& other);
+};
+
+// 64-bit FNV-1a hash of a file's contents, 0 if the file cannot be read
+unsigned long long hashFile(const std::string& filename);
+
+#endif
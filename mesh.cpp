@@ -32,6 +32,7 @@ void Mesh::draw() {
 void Mesh::load(string filename) {
 	// Release resources
 	release();
+	this->filename = filename;
 
 	ifstream file(filename);
 	if (!file.is_open()) {
@@ -15,6 +15,8 @@ public:
 	// Return the bounding box of this object
 	std::pair<glm::vec3, glm::vec3> boundingBox() const
 	{ return std::make_pair(minBB, maxBB); }
+	// Return the file this object was loaded from
+	const std::string& sourceFile() const { return filename; }
 
 	void load(std::string filename);
 	void draw();
@@ -38,6 +40,7 @@ protected:
 	// Bounding box
 	glm::vec3 minBB;
 	glm::vec3 maxBB;
+	std::string filename;
 
 	// OpenGL resources
 	GLuint vao;		// Vertex array object
@@ -0,0 +1,42 @@
+#ifndef PARALLEL_HPP
+#define PARALLEL_HPP
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+// Work splitting shared by the parallel builders and sorts
+const unsigned int MIN_SLICE = 16384;	// Items a worker thread gets at least
+
+// Worker threads used for a number of items
+inline unsigned int workerCount(unsigned int count) {
+	unsigned int cores = std::max(1u, std::thread::hardware_concurrency());
+	return std::max(1u, std::min(cores, count / MIN_SLICE));
+}
+
+// First item of a worker's slice, slices split the items evenly
+inline unsigned int sliceBegin(unsigned int count, unsigned int worker, unsigned int workers) {
+	return (unsigned int)((unsigned long long)count * worker / workers);
+}
+
+// Run body(worker) on every worker, the calling thread is worker 0
+template <class Body>
+void runWorkers(unsigned int workers, const Body& body) {
+	std::vector<std::thread> threads;
+	for (unsigned int w = 1; w < workers; w++)
+		threads.push_back(std::thread(body, w));
+	body(0u);
+	for (unsigned int i = 0; i < threads.size(); i++)
+		threads[i].join();
+}
+
+// Run body(first, last) over the items [0, count), split among the workers
+template <class Body>
+void parallelFor(unsigned int count, const Body& body) {
+	unsigned int workers = workerCount(count);
+	runWorkers(workers, [&](unsigned int w) {
+		body(sliceBegin(count, w, workers), sliceBegin(count, w + 1, workers));
+	});
+}
+
+#endif
@@ -0,0 +1,303 @@
+#include "qbvh4.hpp"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+#include <emmintrin.h>
+using namespace std;
+using namespace glm;
+
+// Traversal stack size, same bound as BVH4
+const int STACK_SIZE = 192;
+const float INV_255 = 1.0f / 255.0f;
+
+// Decoding is written with the same SSE operations as traversal, so the builder
+// can check that every decoded box encloses its exact box bit for bit
+static float quantStep(float pMin, float pMax) {
+	return _mm_cvtss_f32(_mm_mul_ss(_mm_sub_ss(_mm_set_ss(pMax), _mm_set_ss(pMin)), _mm_set_ss(INV_255)));
+}
+static float decodeMin(float pMin, float step, int q) {
+	return _mm_cvtss_f32(_mm_add_ss(_mm_set_ss(pMin), _mm_mul_ss(_mm_set_ss((float)q), _mm_set_ss(step))));
+}
+static float decodeMax(float pMax, float step, int q) {
+	return _mm_cvtss_f32(_mm_sub_ss(_mm_set_ss(pMax), _mm_mul_ss(_mm_set_ss((float)q), _mm_set_ss(step))));
+}
+
+// Quantize [lo, hi] conservatively inside the parent interval, q = 0 decodes to the parent bound itself
+static void quantize(float lo, float hi, float pMin, float pMax, unsigned char& qLo, unsigned char& qHi) {
+	float step = quantStep(pMin, pMax);
+	int a = 0, b = 0;
+	if (step > 0.0f) {
+		a = std::max(0, std::min(255, (int)floor((lo - pMin) / step)));
+		b = std::max(0, std::min(255, (int)floor((pMax - hi) / step)));
+	}
+	while (a > 0 && decodeMin(pMin, step, a) > lo) a--;
+	while (b > 0 && decodeMax(pMax, step, b) < hi) b--;
+	qLo = a;
+	qHi = b;
+}
+
+// Load 4 quantized bounds as floats
+static inline __m128 loadQuant(const unsigned char* q) {
+	int packed;
+	memcpy(&packed, q, sizeof(packed));
+	__m128i zero = _mm_setzero_si128();
+	__m128i v = _mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero);
+	return _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, zero));
+}
+
+QBVH4::QBVH4() {
+	tris = NULL;
+	wide = NULL;
+	minBB = maxBB = vec3(0.0f);
+}
+
+void QBVH4::clear() {
+	nodes.clear();
+	triRefs.clear();
+	tris = NULL;
+	minBB = maxBB = vec3(0.0f);
+}
+
+void QBVH4::build(const BVH4& wide) {
+	clear();
+	if (wide.nodes.empty())
+		return;
+	this->wide = &wide;
+	tris = &wide.source().triangles();
+
+	// The root box is the only one stored in full precision
+	Item root = { false, 0, 0, vec3(FLT_MAX), vec3(-FLT_MAX) };
+	vector<Item> items;
+	children(root, items);
+	for (size_t i = 0; i < items.size(); i++) {
+		minBB = glm::min(minBB, items[i].minBB);
+		maxBB = glm::max(maxBB, items[i].maxBB);
+	}
+	nodes.push_back(Node());
+	emit(0, items, minBB, maxBB);
+
+	nodes.shrink_to_fit();
+	triRefs.shrink_to_fit();
+	this->wide = NULL;
+}
+
+QBVH4::Item QBVH4::rangeItem(unsigned int first, unsigned int count) const {
+	const vector<unsigned int>& triIndices = wide->source().triIndices;
+	Item item = { true, first, count, vec3(FLT_MAX), vec3(-FLT_MAX) };
+	for (unsigned int i = first; i < first + count; i++) {
+		for (int k = 0; k < 3; k++) {
+			item.minBB = glm::min(item.minBB, tris->vertices()[3 * triIndices[i] + k].pos);
+			item.maxBB = glm::max(item.maxBB, tris->vertices()[3 * triIndices[i] + k].pos);
+		}
+	}
+	return item;
+}
+
+void QBVH4::children(const Item& item, vector<Item>& out) const {
+	out.clear();
+	if (item.isRange) {
+		// Leaves too large for the 7-bit count are split into up to 4 chunks
+		unsigned int chunk = (item.count + 3) / 4;
+		for (unsigned int first = item.idx; first < item.idx + item.count; first += chunk)
+			out.push_back(rangeItem(first, std::min(chunk, item.idx + item.count - first)));
+		return;
+	}
+
+	const BVH4::Node& node = wide->nodes[item.idx];
+	for (int i = 0; i < 4; i++) {
+		if (node.minX[i] > node.maxX[i])
+			continue;	// Empty slot
+		Item c = { node.triCount[i] > 0, node.child[i], node.triCount[i],
+			vec3(node.minX[i], node.minY[i], node.minZ[i]), vec3(node.maxX[i], node.maxY[i], node.maxZ[i]) };
+		out.push_back(c);
+	}
+}
+
+void QBVH4::emit(unsigned int nodeIdx, const vector<Item>& items, vec3 pMin, vec3 pMax) {
+	const vector<unsigned int>& triIndices = wide->source().triIndices;
+	Node node;
+	memset(&node, 0, sizeof(node));
+	node.triBase = triRefs.size();
+
+	// Quantize the slots and append the leaf triangles in slot order
+	vector<unsigned int> interior;
+	for (unsigned int i = 0; i < items.size(); i++) {
+		const Item& item = items[i];
+		for (int axis = 0; axis < 3; axis++)
+			quantize(item.minBB[axis], item.maxBB[axis], pMin[axis], pMax[axis], node.qMin[axis][i], node.qMax[axis][i]);
+		if (item.isRange && item.count <= MAX_LEAF_TRIS) {
+			node.meta[i] = SLOT_LEAF | item.count;
+			triRefs.insert(triRefs.end(), triIndices.begin() + item.idx, triIndices.begin() + item.idx + item.count);
+		} else {
+			node.meta[i] = SLOT_NODE;
+			interior.push_back(i);
+		}
+	}
+
+	// Interior children are stored consecutively, and decode from this node's decoded box
+	node.childBase = nodes.size();
+	nodes[nodeIdx] = node;
+	nodes.resize(nodes.size() + interior.size());
+	vector<Item> grandChildren;
+	for (unsigned int k = 0; k < interior.size(); k++) {
+		unsigned int i = interior[k];
+		vec3 cMin, cMax;
+		for (int axis = 0; axis < 3; axis++) {
+			float step = quantStep(pMin[axis], pMax[axis]);
+			cMin[axis] = decodeMin(pMin[axis], step, node.qMin[axis][i]);
+			cMax[axis] = decodeMax(pMax[axis], step, node.qMax[axis][i]);
+		}
+		children(items[i], grandChildren);
+		emit(node.childBase + k, grandChildren, cMin, cMax);
+	}
+}
+
+// Decode the 4 child boxes of a node from the node's decoded box and test them within [0, tMax]
+// Returns the mask of the occupied slots hit, and stores their entry distances and decoded boxes
+static inline int intersectChildren(const QBVH4::Node& node, const float pMin[3], const float pMax[3],
+	const SlabRay& r, float tMax, float dist[4], float lo[3][4], float hi[3][4]) {
+	__m128 inv255 = _mm_set1_ps(INV_255);
+	__m128 pMinX = _mm_set1_ps(pMin[0]), pMaxX = _mm_set1_ps(pMax[0]);
+	__m128 pMinY = _mm_set1_ps(pMin[1]), pMaxY = _mm_set1_ps(pMax[1]);
+	__m128 pMinZ = _mm_set1_ps(pMin[2]), pMaxZ = _mm_set1_ps(pMax[2]);
+	__m128 stepX = _mm_mul_ps(_mm_sub_ps(pMaxX, pMinX), inv255);
+	__m128 stepY = _mm_mul_ps(_mm_sub_ps(pMaxY, pMinY), inv255);
+	__m128 stepZ = _mm_mul_ps(_mm_sub_ps(pMaxZ, pMinZ), inv255);
+	__m128 loX = _mm_add_ps(pMinX, _mm_mul_ps(loadQuant(node.qMin[0]), stepX));
+	__m128 loY = _mm_add_ps(pMinY, _mm_mul_ps(loadQuant(node.qMin[1]), stepY));
+	__m128 loZ = _mm_add_ps(pMinZ, _mm_mul_ps(loadQuant(node.qMin[2]), stepZ));
+	__m128 hiX = _mm_sub_ps(pMaxX, _mm_mul_ps(loadQuant(node.qMax[0]), stepX));
+	__m128 hiY = _mm_sub_ps(pMaxY, _mm_mul_ps(loadQuant(node.qMax[1]), stepY));
+	__m128 hiZ = _mm_sub_ps(pMaxZ, _mm_mul_ps(loadQuant(node.qMax[2]), stepZ));
+	_mm_storeu_ps(lo[0], loX); _mm_storeu_ps(lo[1], loY); _mm_storeu_ps(lo[2], loZ);
+	_mm_storeu_ps(hi[0], hiX); _mm_storeu_ps(hi[1], hiY); _mm_storeu_ps(hi[2], hiZ);
+
+	int mask = intersectBoxes4(r, loX, loY, loZ, hiX, hiY, hiZ, tMax, dist);
+	for (int i = 0; i < 4; i++) {
+		if (node.meta[i] == QBVH4::SLOT_EMPTY)
+			mask &= ~(1 << i);
+	}
+	return mask;
+}
+
+bool QBVH4::intersectCloser(const Ray& ray, float& tHit, unsigned int& triIdx) const {
+	bool hit = tHit != FLT_MAX;
+	if (nodes.empty())
+		return hit;
+	const float ROUNDING = 1.0f + 4.0f * FLT_EPSILON;	// Same widening as intersectBox
+	SlabRay slabRay(ray);
+
+	struct Entry {
+		float minBB[3], maxBB[3];	// Decoded box of a node
+		unsigned int idx;			// Node index, or first entry of triRefs for leaves
+		unsigned int triCount;		// 0 for nodes
+		float t;					// Entry distance of the box
+	};
+	Entry stack[STACK_SIZE];
+	int stackSize = 0;
+	Entry root = { { minBB.x, minBB.y, minBB.z }, { maxBB.x, maxBB.y, maxBB.z }, 0, 0, 0.0f };
+	stack[stackSize++] = root;
+	while (stackSize > 0) {
+		const Entry entry = stack[--stackSize];
+		if (entry.t > tHit * ROUNDING)
+			continue;
+
+		if (entry.triCount > 0) {
+			// Leaf: test its triangles together, ties go to the lower index like a linear scan
+			if (tris->intersect(ray, &triRefs[entry.idx], entry.triCount, tHit, triIdx))
+				hit = true;
+			continue;
+		}
+
+		const Node& node = nodes[entry.idx];
+		float dist[4], lo[3][4], hi[3][4];
+		int mask = intersectChildren(node, entry.minBB, entry.maxBB, slabRay, tHit, dist, lo, hi);
+		if (mask == 0)
+			continue;
+
+		// Sort the hit children by distance, farthest first, and push them
+		Entry hits[4];
+		int hitCount = 0;
+		unsigned int childIdx = node.childBase, triIdxBase = node.triBase;
+		for (int i = 0; i < 4; i++) {
+			unsigned char meta = node.meta[i];
+			Entry e;
+			if (meta & SLOT_LEAF) {
+				e.idx = triIdxBase;
+				e.triCount = meta & MAX_LEAF_TRIS;
+				triIdxBase += e.triCount;
+			} else if (meta == SLOT_NODE) {
+				e.idx = childIdx++;
+				e.triCount = 0;
+			}
+			if (!(mask & (1 << i)))
+				continue;
+			for (int axis = 0; axis < 3; axis++) {
+				e.minBB[axis] = lo[axis][i];
+				e.maxBB[axis] = hi[axis][i];
+			}
+			e.t = dist[i];
+			int j = hitCount++;
+			while (j > 0 && hits[j - 1].t < e.t) {
+				hits[j] = hits[j - 1];
+				j--;
+			}
+			hits[j] = e;
+		}
+		for (int i = 0; i < hitCount; i++)
+			stack[stackSize++] = hits[i];
+	}
+
+	return hit;
+}
+
+bool QBVH4::occluded(const Ray& ray, float tMin, float tMax) const {
+	if (nodes.empty())
+		return false;
+	SlabRay slabRay(ray);
+
+	// As in BVH4: leaves among the children hit are tested right away, interior ones pushed unsorted
+	struct Entry {
+		float minBB[3], maxBB[3];	// Decoded box of a node
+		unsigned int idx;			// Node index
+	};
+	Entry stack[STACK_SIZE];
+	int stackSize = 0;
+	Entry root = { { minBB.x, minBB.y, minBB.z }, { maxBB.x, maxBB.y, maxBB.z }, 0 };
+	stack[stackSize++] = root;
+	while (stackSize > 0) {
+		const Entry entry = stack[--stackSize];
+		const Node& node = nodes[entry.idx];
+		float dist[4], lo[3][4], hi[3][4];
+		int mask = intersectChildren(node, entry.minBB, entry.maxBB, slabRay, tMax, dist, lo, hi);
+		unsigned int childIdx = node.childBase, triIdxBase = node.triBase;
+		for (int i = 0; i < 4; i++) {
+			unsigned char meta = node.meta[i];
+			bool slotHit = (mask & (1 << i)) != 0;
+			if (meta & SLOT_LEAF) {
+				unsigned int count = meta & MAX_LEAF_TRIS;
+				if (slotHit && tris->occluded(ray, &triRefs[triIdxBase], count, tMin, tMax))
+					return true;
+				triIdxBase += count;
+			} else if (meta == SLOT_NODE) {
+				if (slotHit) {
+					Entry e;
+					for (int axis = 0; axis < 3; axis++) {
+						e.minBB[axis] = lo[axis][i];
+						e.maxBB[axis] = hi[axis][i];
+					}
+					e.idx = childIdx;
+					stack[stackSize++] = e;
+				}
+				childIdx++;
+			}
+		}
+	}
+
+	return false;
+}
+
+size_t QBVH4::memoryUsage() const {
+	return nodes.size() * sizeof(Node) + triRefs.size() * sizeof(unsigned int);
+}
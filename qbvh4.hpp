@@ -0,0 +1,68 @@
+#ifndef QBVH4_HPP
+#define QBVH4_HPP
+
+#include <vector>
+#include <glm/glm.hpp>
+#include "mesh.hpp"
+#include "ray.hpp"
+#include "bvh4.hpp"
+#include "accel.hpp"
+
+// Quantized 4-wide bounding volume hierarchy, a compact copy of a BVH4
+// Child boxes are stored as 8-bit offsets inside the parent box, which traversal decodes from
+// the root box down, and the children and leaf triangles of a node are stored consecutively
+class QBVH4 : public Accel {
+public:
+	QBVH4();
+
+	// Compress a built 4-wide hierarchy, only its triangle list must outlive this one
+	void build(const BVH4& wide);
+	void clear();
+
+	// Closest hit nearer than the one tHit and triIdx already hold, see Accel
+	bool intersectCloser(const Ray& ray, float& tHit, unsigned int& triIdx) const;
+	using Accel::intersect;
+	// Whether anything is hit within [tMin, tMax], stopping at the first hit found
+	bool occluded(const Ray& ray, float tMin, float tMax) const;
+	using Accel::occluded;
+	size_t memoryUsage() const;
+	const TriangleStore& triangles() const { return *tris; }
+
+	// Child slot types stored in Node::meta
+	static const unsigned char SLOT_EMPTY = 0x00;
+	static const unsigned char SLOT_NODE = 0x01;
+	static const unsigned char SLOT_LEAF = 0x80;	// Low 7 bits hold the triangle count
+	static const unsigned int MAX_LEAF_TRIS = 0x7F;
+
+	// Node format (36 bytes)
+	struct Node {
+		unsigned char qMin[3][4];	// Child box lower bounds, in 1/255 steps up from the parent minimum
+		unsigned char qMax[3][4];	// Child box upper bounds, in 1/255 steps down from the parent maximum
+		unsigned char meta[4];		// Slot type, and triangle count for leaves
+		unsigned int childBase;		// Node index of the first interior child
+		unsigned int triBase;		// Entry of triRefs of the first leaf triangle
+	};
+	// Hierarchy data, the root is nodes[0] and covers [minBB, maxBB]
+	std::vector<Node> nodes;
+	std::vector<unsigned int> triRefs;
+	glm::vec3 minBB;
+	glm::vec3 maxBB;
+
+protected:
+	const TriangleStore* tris;		// Triangles the hierarchy was built over
+
+	// Child of a node being compressed: a BVH4 node, or a range of triangle indices
+	struct Item {
+		bool isRange;
+		unsigned int idx;		// BVH4 node index, or first entry of the range
+		unsigned int count;		// Number of triangles of a range
+		glm::vec3 minBB, maxBB;
+	};
+	void emit(unsigned int nodeIdx, const std::vector<Item>& items, glm::vec3 pMin, glm::vec3 pMax);
+	void children(const Item& item, std::vector<Item>& out) const;
+	Item rangeItem(unsigned int first, unsigned int count) const;
+
+	const BVH4* wide;				// Source hierarchy while building
+};
+
+#endif
@@ -0,0 +1,40 @@
+#include "radixsort.hpp"
+#include "parallel.hpp"
+using namespace std;
+
+const int RADIX_BITS = 10;		// Digit width, one pass per 10 bits of key
+
+// Least significant digit first. Each worker counts the digits of its slice, then scatters the
+// slice behind the counts of the digits below and of the same digit in the slices before it
+void radixSort(vector<unsigned int>& codes, vector<unsigned int>& ids, int keyBits) {
+	const unsigned int BUCKETS = 1 << RADIX_BITS;
+	unsigned int count = codes.size();
+	unsigned int workers = workerCount(count);
+	vector<unsigned int> codesOut(count), idsOut(count);
+	vector<unsigned int> offsets(workers * BUCKETS);
+	for (int shift = 0; shift < keyBits; shift += RADIX_BITS) {
+		runWorkers(workers, [&](unsigned int w) {
+			unsigned int* counts = &offsets[w * BUCKETS];
+			std::fill(counts, counts + BUCKETS, 0);
+			for (unsigned int i = sliceBegin(count, w, workers); i < sliceBegin(count, w + 1, workers); i++)
+				counts[(codes[i] >> shift) & (BUCKETS - 1)]++;
+		});
+		unsigned int sum = 0;
+		for (unsigned int b = 0; b < BUCKETS; b++)
+			for (unsigned int w = 0; w < workers; w++) {
+				unsigned int n = offsets[w * BUCKETS + b];
+				offsets[w * BUCKETS + b] = sum;
+				sum += n;
+			}
+		runWorkers(workers, [&](unsigned int w) {
+			unsigned int* next = &offsets[w * BUCKETS];
+			for (unsigned int i = sliceBegin(count, w, workers); i < sliceBegin(count, w + 1, workers); i++) {
+				unsigned int dst = next[(codes[i] >> shift) & (BUCKETS - 1)]++;
+				codesOut[dst] = codes[i];
+				idsOut[dst] = ids[i];
+			}
+		});
+		codes.swap(codesOut);
+		ids.swap(idsOut);
+	}
+}
@@ -0,0 +1,18 @@
+#ifndef RADIXSORT_HPP
+#define RADIXSORT_HPP
+
+#include <vector>
+
+// Spread the low 10 bits of v apart, two zero bits after each, to interleave 3 axes into a Morton code
+inline unsigned int expandBits(unsigned int v) {
+	v = (v * 0x00010001u) & 0xFF0000FFu;
+	v = (v * 0x00000101u) & 0x0F00F00Fu;
+	v = (v * 0x00000011u) & 0xC30C30C3u;
+	v = (v * 0x00000005u) & 0x49249249u;
+	return v;
+}
+
+// Stable parallel sort of keys below 2^keyBits, with the ids moved along
+void radixSort(std::vector<unsigned int>& codes, std::vector<unsigned int>& ids, int keyBits);
+
+#endif
@@ -0,0 +1,66 @@
+#include "ray.hpp"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+using namespace std;
+using namespace glm;
+
+void RayPacket::finish() {
+	origMin = invMin = dirMin = vec3(FLT_MAX);
+	origMax = invMax = dirMax = vec3(-FLT_MAX);
+	for (int i = 0; i < count; i++) {
+		invDir[i] = 1.0f / rays[i].dir;
+		origMin = glm::min(origMin, rays[i].orig);
+		origMax = glm::max(origMax, rays[i].orig);
+		invMin = glm::min(invMin, invDir[i]);
+		invMax = glm::max(invMax, invDir[i]);
+		dirMin = glm::min(dirMin, rays[i].dir);
+		dirMax = glm::max(dirMax, rays[i].dir);
+	}
+	for (int axis = 0; axis < 3; axis++) {
+		flat[axis] = dirMin[axis] == 0.0f && dirMax[axis] == 0.0f;
+		spans[axis] = !flat[axis] && dirMin[axis] <= 0.0f && dirMax[axis] >= 0.0f;
+	}
+}
+
+bool RayPacket::coherent() const {
+	// A slab bounds the packet only along axes where all directions share a sign
+	return count > 0 && (int)spans[0] + (int)spans[1] + (int)spans[2] <= 1;
+}
+
+float RayPacket::spread(float t) const {
+	vec3 extent = origMax - origMin + t * (dirMax - dirMin);
+	return glm::max(extent.x, glm::max(extent.y, extent.z));
+}
+
+float RayPacket::intersectBox(const vec3& minBB, const vec3& maxBB, float tMax) const {
+	// Same widening as the single ray test
+	const float ROUNDING = 1.0f + 4.0f * FLT_EPSILON;
+	float tEnter = 0.0f;
+	float tExit = tMax * ROUNDING;
+	for (int axis = 0; axis < 3; axis++) {
+		if (flat[axis]) {
+			// Rays parallel to the slab only hit it if they start inside it
+			if (origMax[axis] < minBB[axis] || origMin[axis] > maxBB[axis])
+				return FLT_MAX;
+			continue;
+		}
+		if (spans[axis])
+			continue;
+		// Near and far planes depend on the shared direction sign
+		float nearPlane = invMin[axis] < 0.0f ? maxBB[axis] : minBB[axis];
+		float farPlane = invMin[axis] < 0.0f ? minBB[axis] : maxBB[axis];
+		// Interval products over the bounds, rounding is monotone so every ray's own
+		// slab distances computed by intersectBox stay inside them
+		float n0 = nearPlane - origMax[axis], n1 = nearPlane - origMin[axis];
+		float f0 = farPlane - origMax[axis], f1 = farPlane - origMin[axis];
+		float tNear = std::min(std::min(n0 * invMin[axis], n0 * invMax[axis]), std::min(n1 * invMin[axis], n1 * invMax[axis]));
+		float tFar = std::max(std::max(f0 * invMin[axis], f0 * invMax[axis]), std::max(f1 * invMin[axis], f1 * invMax[axis]));
+		tFar *= ROUNDING;
+		tEnter = std::max(tEnter, tNear);
+		tExit = std::min(tExit, tFar);
+		if (tEnter > tExit)
+			return FLT_MAX;
+	}
+	return tEnter;
+}
@@ -0,0 +1,56 @@
+#ifndef RAY_HPP
+#define RAY_HPP
+
+#include <cfloat>
+#include <glm/glm.hpp>
+#include "mesh.hpp"
+
+// Ray vertex format
+struct Ray {
+	glm::vec3 orig;
+	glm::vec3 dir;
+};
+
+// Closest hit of a ray, all that shading needs once the traversal is done
+// bary holds the hit point's weights of the triangle's second and third vertices
+struct Hit {
+	static const unsigned int NONE = 0xFFFFFFFF;
+
+	float t;
+	unsigned int triIdx;	// NONE when nothing is hit
+	unsigned int instIdx;	// Instance of a scene, NONE for a single mesh
+	glm::vec2 bary;
+
+	Hit() : t(FLT_MAX), triIdx(NONE), instIdx(NONE), bary(0.0f) {}
+	bool valid() const { return triIdx != NONE; }
+};
+
+// Block of coherent rays traced together, such as the rays of 8x8 neighboring pixels
+// The bounds of its origins and inverse directions make an interval arithmetic frustum
+struct RayPacket {
+	static const int MAX_RAYS = 64;
+
+	int count;
+	Ray rays[MAX_RAYS];
+	glm::vec3 invDir[MAX_RAYS];
+	// Bounds over the rays, filled by finish()
+	glm::vec3 origMin, origMax;
+	glm::vec3 invMin, invMax;
+	glm::vec3 dirMin, dirMax;
+	bool spans[3];		// Whether the direction changes sign along an axis
+	bool flat[3];		// Whether the direction is zero for all rays along an axis
+
+	RayPacket() : count(0) {}
+	void add(const Ray& ray) { rays[count++] = ray; }
+	// Compute the inverse directions and the bounds after the rays were added
+	void finish();
+	// Whether the frustum is tight enough to trace the rays together
+	bool coherent() const;
+	// Largest extent of the packet's cross-section at distance t
+	float spread(float t) const;
+	// Slab test of the whole packet against a box within [0, tMax], return a lower bound of
+	// the rays' entry distances or FLT_MAX if no ray of the packet can hit the box
+	float intersectBox(const glm::vec3& minBB, const glm::vec3& maxBB, float tMax) const;
+};
+
+#endif
@@ -0,0 +1,62 @@
+#include "raysort.hpp"
+#include "radixsort.hpp"
+#include <cfloat>
+using namespace std;
+using namespace glm;
+
+// Sort key: direction octant in the top 3 bits, above 9 bits per origin axis interleaved
+const int ORIGIN_BITS = 9;
+const int KEY_BITS = 3 + 3 * ORIGIN_BITS;
+
+RaySorter::RaySorter() {
+	blockedCapacity = 0;
+}
+
+void RaySorter::sort(const Ray* rays, unsigned int count) {
+	// Origin bounds of the batch, the Morton grid spans them
+	vec3 minO(FLT_MAX), maxO(-FLT_MAX);
+	for (unsigned int i = 0; i < count; i++) {
+		minO = glm::min(minO, rays[i].orig);
+		maxO = glm::max(maxO, rays[i].orig);
+	}
+	const int cells = 1 << ORIGIN_BITS;
+	vec3 extent = maxO - minO;
+	vec3 scale(extent.x > 0.0f ? cells / extent.x : 0.0f, extent.y > 0.0f ? cells / extent.y : 0.0f,
+		extent.z > 0.0f ? cells / extent.z : 0.0f);
+
+	keys.resize(count);
+	order.resize(count);
+	for (unsigned int i = 0; i < count; i++) {
+		const Ray& ray = rays[i];
+		unsigned int octant = (ray.dir.x < 0.0f ? 4 : 0) | (ray.dir.y < 0.0f ? 2 : 0) | (ray.dir.z < 0.0f ? 1 : 0);
+		ivec3 q = glm::clamp(ivec3((ray.orig - minO) * scale), ivec3(0), ivec3(cells - 1));
+		keys[i] = (octant << (3 * ORIGIN_BITS)) | (expandBits(q.x) << 2) | (expandBits(q.y) << 1) | expandBits(q.z);
+		order[i] = i;
+	}
+	radixSort(keys, order, KEY_BITS);
+}
+
+void RaySorter::intersect(const Accel& accel, const Ray* rays, unsigned int count, Hit* hits) {
+	sort(rays, count);
+	sortedRays.resize(count);
+	sortedHits.resize(count);
+	for (unsigned int k = 0; k < count; k++)
+		sortedRays[k] = rays[order[k]];
+	accel.intersect(sortedRays.data(), count, sortedHits.data());
+	for (unsigned int k = 0; k < count; k++)
+		hits[order[k]] = sortedHits[k];
+}
+
+void RaySorter::occluded(const Accel& accel, const Ray* rays, unsigned int count, float tMin, float tMax, bool* blocked) {
+	sort(rays, count);
+	sortedRays.resize(count);
+	if (blockedCapacity < count) {
+		sortedBlocked.reset(new bool[count]);
+		blockedCapacity = count;
+	}
+	for (unsigned int k = 0; k < count; k++)
+		sortedRays[k] = rays[order[k]];
+	accel.occluded(sortedRays.data(), count, tMin, tMax, sortedBlocked.get());
+	for (unsigned int k = 0; k < count; k++)
+		blocked[order[k]] = sortedBlocked[k];
+}
@@ -0,0 +1,35 @@
+#ifndef RAYSORT_HPP
+#define RAYSORT_HPP
+
+#include <memory>
+#include <vector>
+#include <glm/glm.hpp>
+#include "ray.hpp"
+#include "accel.hpp"
+
+// Reordering stage for incoherent batches such as shadow, ambient occlusion or reflection rays
+// Rays are sorted by direction octant, then along a Morton curve over their origins, so that rays
+// traced one after another visit the same nodes and triangles. Results are scattered back to the
+// order the rays came in
+class RaySorter {
+public:
+	RaySorter();
+
+	// Find the traversal order of count rays
+	void sort(const Ray* rays, unsigned int count);
+	// Trace the rays in sorted order, results land at the same index as their ray
+	void intersect(const Accel& accel, const Ray* rays, unsigned int count, Hit* hits);
+	void occluded(const Accel& accel, const Ray* rays, unsigned int count, float tMin, float tMax, bool* blocked);
+
+	// Index of the ray traced k-th, filled by sort
+	std::vector<unsigned int> order;
+
+protected:
+	std::vector<unsigned int> keys;
+	std::vector<Ray> sortedRays;	// The rays in traversal order
+	std::vector<Hit> sortedHits;
+	std::unique_ptr<bool[]> sortedBlocked;
+	unsigned int blockedCapacity;
+};
+
+#endif
@@ -0,0 +1,302 @@
+#include "scene.hpp"
+#include <algorithm>
+#include <cfloat>
+using namespace std;
+using namespace glm;
+
+// Build parameters
+const unsigned int MAX_LEAF_INSTANCES = 2;	// Instances per top-level leaf
+const int STACK_SIZE = 64;					// Top-level depth is logarithmic, splits fall back to the median
+
+Scene::Scene() {
+}
+
+void Scene::clear() {
+	for (unsigned int i = 0; i < prototypes.size(); i++)
+		delete prototypes[i];
+	prototypes.clear();
+	instances.clear();
+	nodes.clear();
+	instIndices.clear();
+}
+
+unsigned int Scene::addMesh(const Mesh& mesh) {
+	Prototype* proto = new Prototype();
+	prototypes.push_back(proto);
+
+	// Object space triangle positions, like the single mesh path the store provides the face normals
+	proto->verts.resize(mesh.v_elements.size() / 3 * 3);
+	for (unsigned int i = 0; i < proto->verts.size(); i++)
+		proto->verts[i].pos = mesh.raw_vertices[mesh.v_elements[i]];
+	pair<vec3, vec3> meshBB = mesh.boundingBox();
+	proto->minBB = meshBB.first;
+	proto->maxBB = meshBB.second;
+
+	proto->tris.build(proto->verts);
+	proto->bvh.build(proto->tris);
+	proto->bvh4.build(proto->bvh);
+	// Only the triangle order of the binary build is used after collapsing it
+	proto->bvh.nodes.clear();
+	proto->bvh.nodes.shrink_to_fit();
+	return prototypes.size() - 1;
+}
+
+unsigned int Scene::addInstance(unsigned int meshIdx, const mat4& objToScene) {
+	const Prototype& proto = *prototypes.at(meshIdx);
+	Instance inst;
+	inst.meshIdx = meshIdx;
+	inst.objToScene = objToScene;
+	inst.sceneToObj = inverse(objToScene);
+	inst.normalXform = transpose(mat3(inst.sceneToObj));
+
+	// Scene space box around the transformed corners of the mesh box
+	inst.minBB = vec3(FLT_MAX);
+	inst.maxBB = vec3(-FLT_MAX);
+	for (int c = 0; c < 8; c++) {
+		vec3 corner((c & 1) ? proto.maxBB.x : proto.minBB.x,
+			(c & 2) ? proto.maxBB.y : proto.minBB.y,
+			(c & 4) ? proto.maxBB.z : proto.minBB.z);
+		vec3 p = vec3(objToScene * vec4(corner, 1.0f));
+		inst.minBB = glm::min(inst.minBB, p);
+		inst.maxBB = glm::max(inst.maxBB, p);
+	}
+	instances.push_back(inst);
+	return instances.size() - 1;
+}
+
+void Scene::build() {
+	nodes.clear();
+	instIndices.clear();
+	unsigned int count = instances.size();
+	if (count == 0)
+		return;
+
+	vector<vec3> centroids(count);
+	instIndices.resize(count);
+	for (unsigned int i = 0; i < count; i++) {
+		centroids[i] = (instances[i].minBB + instances[i].maxBB) * 0.5f;
+		instIndices[i] = i;
+	}
+
+	nodes.reserve(2 * count - 1);
+	BVH::Node root;
+	root.leftFirst = 0;
+	root.triCount = count;
+	nodes.push_back(root);
+	subdivide(0, centroids);
+}
+
+void Scene::subdivide(unsigned int nodeIdx, const vector<vec3>& centroids) {
+	unsigned int first = nodes[nodeIdx].leftFirst;
+	unsigned int count = nodes[nodeIdx].triCount;
+
+	// Fit the node to its instances
+	vec3 minBB(FLT_MAX), maxBB(-FLT_MAX);
+	vec3 minC(FLT_MAX), maxC(-FLT_MAX);
+	for (unsigned int i = first; i < first + count; i++) {
+		const Instance& inst = instances[instIndices[i]];
+		minBB = glm::min(minBB, inst.minBB);
+		maxBB = glm::max(maxBB, inst.maxBB);
+		minC = glm::min(minC, centroids[instIndices[i]]);
+		maxC = glm::max(maxC, centroids[instIndices[i]]);
+	}
+	nodes[nodeIdx].minBB = minBB;
+	nodes[nodeIdx].maxBB = maxBB;
+	if (count <= MAX_LEAF_INSTANCES)
+		return;
+
+	// Split the longest centroid axis in the middle, or at the median if that leaves a side empty
+	vec3 extent = maxC - minC;
+	int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+	float split = (minC[axis] + maxC[axis]) * 0.5f;
+	unsigned int* begin = &instIndices[first];
+	unsigned int* mid = std::partition(begin, begin + count,
+		[&](unsigned int inst) { return centroids[inst][axis] < split; });
+	if (mid == begin || mid == begin + count) {
+		mid = begin + count / 2;
+		std::nth_element(begin, mid, begin + count,
+			[&](unsigned int a, unsigned int b) { return centroids[a][axis] < centroids[b][axis]; });
+	}
+	unsigned int leftCount = mid - begin;
+
+	// Children are stored next to each other
+	unsigned int leftIdx = nodes.size();
+	BVH::Node left, right;
+	left.leftFirst = first;
+	left.triCount = leftCount;
+	right.leftFirst = first + leftCount;
+	right.triCount = count - leftCount;
+	nodes.push_back(left);
+	nodes.push_back(right);
+	nodes[nodeIdx].leftFirst = leftIdx;
+	nodes[nodeIdx].triCount = 0;
+
+	subdivide(leftIdx, centroids);
+	subdivide(leftIdx + 1, centroids);
+}
+
+// Ray carried into an instance's object space
+// The transforms are affine, so t means the same distance along the ray in both spaces
+static Ray objectRay(const Scene::Instance& inst, const Ray& ray) {
+	Ray objRay = {
+		vec3(inst.sceneToObj * vec4(ray.orig, 1.0f)),
+		vec3(inst.sceneToObj * vec4(ray.dir, 0.0f))
+	};
+	return objRay;
+}
+
+bool Scene::intersect(const Ray& ray, Hit& hit) const {
+	hit = Hit();
+	Ray hitRay;
+	if (!intersectCloser(ray, hit, hitRay))
+		return false;
+	// Barycentrics in the winning instance's object space, where its triangles are stored
+	prototypes[instances[hit.instIdx].meshIdx]->tris.intersect(hitRay, hit.triIdx, hit.bary);
+	return true;
+}
+
+bool Scene::intersectCloser(const Ray& ray, Hit& hit, Ray& hitRay) const {
+	if (nodes.empty())
+		return hit.valid();
+	vec3 invDir = 1.0f / ray.dir;	// Zero components become infinities
+
+	// Depth-first, nearest child first
+	unsigned int stack[STACK_SIZE];
+	int stackSize = 0;
+	if (intersectBox(ray.orig, invDir, nodes[0].minBB, nodes[0].maxBB, hit.t) == FLT_MAX)
+		return hit.valid();
+	stack[stackSize++] = 0;
+	while (stackSize > 0) {
+		const BVH::Node& node = nodes[stack[--stackSize]];
+		if (node.triCount > 0) {
+			// Leaf: trace each instance's mesh with the ray in its object space, culling against the hit so far
+			for (unsigned int i = node.leftFirst; i < node.leftFirst + node.triCount; i++) {
+				unsigned int idx = instIndices[i];
+				const Instance& inst = instances[idx];
+				Ray objRay = objectRay(inst, ray);
+				// Triangle indices only order the hits of one instance, on a tie at hit.t the lower instance
+				// wins. A seed of NONE lets any triangle at that distance win, a seed of 0 none of them
+				unsigned int seed = idx == hit.instIdx ? hit.triIdx : idx < hit.instIdx ? Hit::NONE : 0;
+				float t = hit.t;
+				unsigned int tri = seed;
+				if (prototypes[inst.meshIdx]->bvh4.intersectCloser(objRay, t, tri) && (t != hit.t || tri != seed)) {
+					hit.t = t;
+					hit.triIdx = tri;
+					hit.instIdx = idx;
+					hitRay = objRay;
+				}
+			}
+			continue;
+		}
+
+		// Interior: push the children that are hit, farther one first
+		unsigned int leftIdx = node.leftFirst;
+		float tLeft = intersectBox(ray.orig, invDir, nodes[leftIdx].minBB, nodes[leftIdx].maxBB, hit.t);
+		float tRight = intersectBox(ray.orig, invDir, nodes[leftIdx + 1].minBB, nodes[leftIdx + 1].maxBB, hit.t);
+		if (tLeft <= tRight) {
+			if (tRight != FLT_MAX) stack[stackSize++] = leftIdx + 1;
+			if (tLeft != FLT_MAX) stack[stackSize++] = leftIdx;
+		} else {
+			if (tLeft != FLT_MAX) stack[stackSize++] = leftIdx;
+			if (tRight != FLT_MAX) stack[stackSize++] = leftIdx + 1;
+		}
+	}
+
+	return hit.valid();
+}
+
+bool Scene::occluded(const Ray& ray, float tMin, float tMax) const {
+	if (nodes.empty())
+		return false;
+	vec3 invDir = 1.0f / ray.dir;	// Zero components become infinities
+
+	// Order does not matter once any hit ends the search, children are pushed as they come
+	unsigned int stack[STACK_SIZE];
+	int stackSize = 0;
+	if (intersectBox(ray.orig, invDir, nodes[0].minBB, nodes[0].maxBB, tMax) == FLT_MAX)
+		return false;
+	stack[stackSize++] = 0;
+	while (stackSize > 0) {
+		const BVH::Node& node = nodes[stack[--stackSize]];
+		if (node.triCount > 0) {
+			for (unsigned int i = node.leftFirst; i < node.leftFirst + node.triCount; i++) {
+				const Instance& inst = instances[instIndices[i]];
+				if (prototypes[inst.meshIdx]->bvh4.occluded(objectRay(inst, ray), tMin, tMax))
+					return true;
+			}
+			continue;
+		}
+
+		unsigned int leftIdx = node.leftFirst;
+		if (intersectBox(ray.orig, invDir, nodes[leftIdx].minBB, nodes[leftIdx].maxBB, tMax) != FLT_MAX)
+			stack[stackSize++] = leftIdx;
+		if (intersectBox(ray.orig, invDir, nodes[leftIdx + 1].minBB, nodes[leftIdx + 1].maxBB, tMax) != FLT_MAX)
+			stack[stackSize++] = leftIdx + 1;
+	}
+
+	return false;
+}
+
+void Scene::intersect(const Ray* rays, unsigned int count, Hit* hits, CacheStats* stats) const {
+	// Each ray first tests the triangle of the instance the previous ray hit, as Accel's stream does
+	Hit last;
+	unsigned long long tested = 0, cached = 0;
+	for (unsigned int i = 0; i < count; i++) {
+		Hit& hit = hits[i];
+		hit = Hit();
+		Ray hitRay;
+		if (last.valid()) {
+			tested++;
+			const Instance& inst = instances[last.instIdx];
+			Ray objRay = objectRay(inst, rays[i]);
+			float t = prototypes[inst.meshIdx]->tris.intersect(objRay, last.triIdx);
+			if (t >= 0.0f) {
+				hit.t = t;
+				hit.triIdx = last.triIdx;
+				hit.instIdx = last.instIdx;
+				hitRay = objRay;
+				cached++;
+			}
+		}
+		if (intersectCloser(rays[i], hit, hitRay))
+			prototypes[instances[hit.instIdx].meshIdx]->tris.intersect(hitRay, hit.triIdx, hit.bary);
+		last = hit;
+	}
+	if (stats) {
+		stats->tested += tested;
+		stats->hits += cached;
+	}
+}
+
+void Scene::occluded(const Ray* rays, unsigned int count, float tMin, float tMax, bool* blocked) const {
+	for (unsigned int i = 0; i < count; i++)
+		blocked[i] = occluded(rays[i], tMin, tMax);
+}
+
+vec3 Scene::normal(const Hit& hit) const {
+	const Instance& inst = instances[hit.instIdx];
+	// Prototype stores are in mesh order, slot triIdx holds triangle triIdx
+	return inst.normalXform * prototypes[inst.meshIdx]->tris.normal(hit.triIdx);
+}
+
+size_t Scene::memoryUsage() const {
+	size_t bytes = nodes.size() * sizeof(BVH::Node) + instIndices.size() * sizeof(unsigned int) +
+		instances.size() * sizeof(Instance);
+	for (unsigned int i = 0; i < prototypes.size(); i++) {
+		const Prototype& proto = *prototypes[i];
+		bytes += proto.verts.size() * sizeof(Mesh::Vtx) + proto.tris.memoryUsage() +
+			proto.bvh.leafTriangles().memoryUsage() + proto.bvh4.memoryUsage();
+	}
+	return bytes;
+}
+
+size_t Scene::flattenedMemoryUsage() const {
+	// Every instance would carry its own copy of the triangles and the hierarchy over them
+	size_t bytes = 0;
+	for (unsigned int i = 0; i < instances.size(); i++) {
+		const Prototype& proto = *prototypes[instances[i].meshIdx];
+		bytes += proto.verts.size() * sizeof(Mesh::Vtx) + proto.tris.memoryUsage() +
+			proto.bvh.leafTriangles().memoryUsage() + proto.bvh4.memoryUsage();
+	}
+	return bytes;
+}
@@ -0,0 +1,80 @@
+#ifndef SCENE_HPP
+#define SCENE_HPP
+
+#include <vector>
+#include <glm/glm.hpp>
+#include "mesh.hpp"
+#include "ray.hpp"
+#include "bvh.hpp"
+#include "bvh4.hpp"
+
+// Two-level acceleration structure over instances of shared meshes
+// Each unique mesh keeps one object space hierarchy that all of its instances share,
+// a top-level hierarchy over the instance boxes routes rays to the instances they may hit
+class Scene {
+public:
+	Scene();
+	~Scene() { clear(); }
+
+	// Add a mesh and build its bottom-level hierarchy, return the mesh index
+	unsigned int addMesh(const Mesh& mesh);
+	// Place a mesh in the scene, return the instance index
+	unsigned int addInstance(unsigned int meshIdx, const glm::mat4& objToScene);
+	// Build the top-level hierarchy, after all instances were added
+	void build();
+	void clear();
+
+	// Find the closest hit along a scene space ray, return false if nothing is hit
+	bool intersect(const Ray& ray, Hit& hit) const;
+	// Whether any instance is hit within [tMin, tMax], stopping at the first hit found
+	bool occluded(const Ray& ray, float tMin, float tMax) const;
+	// Stream queries over count rays at once, results at the same index as their ray
+	// Each ray first tests the triangle the previous ray hit, see Accel
+	void intersect(const Ray* rays, unsigned int count, Hit* hits, CacheStats* stats = NULL) const;
+	void occluded(const Ray* rays, unsigned int count, float tMin, float tMax, bool* blocked) const;
+	// Scene space normal at a hit, the face normal of the triangle hit
+	glm::vec3 normal(const Hit& hit) const;
+
+	// Memory used by hierarchies, triangles and instances in bytes
+	size_t memoryUsage() const;
+	// Memory a single-level copy with every instance's triangles would use
+	size_t flattenedMemoryUsage() const;
+
+	unsigned int meshCount() const { return prototypes.size(); }
+	unsigned int instanceCount() const { return instances.size(); }
+
+	// Geometry shared by the instances of one mesh, in object space
+	struct Prototype {
+		std::vector<Mesh::Vtx> verts;
+		TriangleStore tris;		// Prepared for ray tests from verts
+		BVH bvh;
+		BVH4 bvh4;
+		glm::vec3 minBB, maxBB;
+	};
+	struct Instance {
+		unsigned int meshIdx;
+		glm::mat4 objToScene;
+		glm::mat4 sceneToObj;	// Applied to the rays
+		glm::mat3 normalXform;	// Inverse transpose of the linear part, carries normals to scene space
+		glm::vec3 minBB, maxBB;	// Scene space box
+	};
+	// Top-level hierarchy, leaves index into instIndices
+	std::vector<BVH::Node> nodes;
+	std::vector<unsigned int> instIndices;
+
+protected:
+	std::vector<Prototype*> prototypes;		// Heap allocated, the hierarchies reference their verts
+	std::vector<Instance> instances;
+
+	void subdivide(unsigned int nodeIdx, const std::vector<glm::vec3>& centroids);
+	// Closest hit nearer than the one hit already holds, with hitRay the object space ray of its instance
+	// The tie rule is the lower instance, then the lower triangle. Returns whether hit holds a hit afterwards
+	bool intersectCloser(const Ray& ray, Hit& hit, Ray& hitRay) const;
+
+private:
+	// Disallow copy
+	Scene(const Scene& other);
+	Scene& operator=(const Scene& other);
+};
+
+#endif
@@ -0,0 +1,191 @@
+#include "tilebin.hpp"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+using namespace std;
+using namespace glm;
+
+// Footprints are widened by this many pixels to cover rounding and the ray test's tolerance
+const float PIXEL_MARGIN = 1.0f;
+// Triangles this close to a plane where the projection is singular are listed in every tile
+const float MIN_DENOMINATOR = 1e-3f;
+// Listed triangles passed to the list test at once, the widest kernel's lane count
+const unsigned int BATCH_SIZE = 16;
+
+// Affine map from image plane (s, t) to uv plane (u, v) of the GLC, uv = m * st + c
+static bool uvMap(const vector<vec3>& imagePlaneVerts, const vector<vec3>& uvPlaneVerts, mat2& m, vec2& c) {
+	vec2 st3(imagePlaneVerts[2]), uv3(uvPlaneVerts[2]);
+	mat2 st(vec2(imagePlaneVerts[0]) - st3, vec2(imagePlaneVerts[1]) - st3);
+	mat2 uv(vec2(uvPlaneVerts[0]) - uv3, vec2(uvPlaneVerts[1]) - uv3);
+	if (determinant(st) == 0.0f)
+		return false;
+	m = uv * inverse(st);
+	c = uv3 - m * st3;
+	return true;
+}
+
+TileBins::TileBins() {
+	tris = NULL;
+	tilesX = tilesY = 0;
+}
+
+void TileBins::clear() {
+	tileStart.clear();
+	tileTris.clear();
+	footprints.clear();
+	glcTris.clear();
+	tris = NULL;
+	tilesX = tilesY = 0;
+}
+
+bool TileBins::supported(const vector<vec3>& imagePlaneVerts, const vector<vec3>& uvPlaneVerts) {
+	// A point at height z lies on the ray of st with xy = ((1 - z) I + z m) st + z c,
+	// solving for st gives a linear fraction per axis when m is diagonal
+	mat2 m;
+	vec2 c;
+	if (!uvMap(imagePlaneVerts, uvPlaneVerts, m, c))
+		return false;
+	float scale = 1e-6f * (1.0f + fabs(m[0][0]) + fabs(m[1][1]));
+	return fabs(m[1][0]) <= scale && fabs(m[0][1]) <= scale;
+}
+
+void TileBins::build(const vector<vec3>& imagePlaneVerts, const vector<vec3>& uvPlaneVerts,
+	const TriangleStore& tris, const mat4& objToWorld, int width, int height, float clipW, float clipH) {
+	clear();
+	this->tris = &tris;
+	const vector<Mesh::Vtx>& verts = tris.vertices();
+	tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+	tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+	unsigned int tileCount = tilesX * tilesY;
+	unsigned int triCount = verts.size() / 3;
+
+	mat2 m(1.0f);
+	vec2 c(0.0f);
+	bool linear = supported(imagePlaneVerts, uvPlaneVerts) && uvMap(imagePlaneVerts, uvPlaneVerts, m, c);
+
+	// Pixel range of each triangle, empty if it cannot be seen
+	footprints.resize(triCount);
+	i16vec4 everywhere(0, 0, width - 1, height - 1), nowhere(0, 0, -1, -1);
+	for (unsigned int i = 0; i < triCount; i++) {
+		vec3 w[3];
+		for (int k = 0; k < 3; k++)
+			w[k] = vec3(objToWorld * vec4(verts[3 * i + k].pos, 1.0f));
+		float zMin = glm::min(w[0].z, glm::min(w[1].z, w[2].z));
+		float zMax = glm::max(w[0].z, glm::max(w[1].z, w[2].z));
+		// Rays start on the uv plane (z = 1) and head down
+		if (zMin > 1.0f) {
+			footprints[i] = nowhere;
+			continue;
+		}
+		// The denominators are affine in z, so their ends bound them over the triangle
+		float dsMin = glm::min(1.0f + zMin * (m[0][0] - 1.0f), 1.0f + zMax * (m[0][0] - 1.0f));
+		float dtMin = glm::min(1.0f + zMin * (m[1][1] - 1.0f), 1.0f + zMax * (m[1][1] - 1.0f));
+		if (!linear || zMax > 1.0f || dsMin < MIN_DENOMINATOR || dtMin < MIN_DENOMINATOR) {
+			footprints[i] = everywhere;
+			continue;
+		}
+
+		// Linear fractions over a triangle are extreme at its vertices
+		vec2 lo(FLT_MAX), hi(-FLT_MAX);
+		for (int k = 0; k < 3; k++) {
+			vec2 st((w[k].x - w[k].z * c.x) / (1.0f + w[k].z * (m[0][0] - 1.0f)),
+				(w[k].y - w[k].z * c.y) / (1.0f + w[k].z * (m[1][1] - 1.0f)));
+			lo = glm::min(lo, st);
+			hi = glm::max(hi, st);
+		}
+		// Pixel x has s = (x - width / 2) * clipW / width, likewise for y and t
+		vec2 pixelScale(width / clipW, height / clipH);
+		vec2 center(width / 2, height / 2);
+		vec2 pLo = glm::floor(lo * pixelScale + center) - PIXEL_MARGIN;
+		vec2 pHi = glm::ceil(hi * pixelScale + center) + PIXEL_MARGIN;
+		if (!(pLo.x < width && pLo.y < height && pHi.x >= 0.0f && pHi.y >= 0.0f)) {
+			footprints[i] = nowhere;
+			continue;
+		}
+		pLo = glm::max(pLo, vec2(0.0f));
+		pHi = glm::min(pHi, vec2(width - 1, height - 1));
+		footprints[i] = i16vec4(pLo.x, pLo.y, pHi.x, pHi.y);
+	}
+
+	glcTris.build(tris, objToWorld);
+
+	// Count the triangles of each tile, then fill the lists behind the prefix sums
+	tileStart.assign(tileCount + 1, 0);
+	for (int pass = 0; pass < 2; pass++) {
+		for (unsigned int i = 0; i < triCount; i++) {
+			const i16vec4& f = footprints[i];
+			if (f.x > f.z)
+				continue;
+			for (int y = f.y / TILE_SIZE; y <= f.w / TILE_SIZE; y++)
+				for (int x = f.x / TILE_SIZE; x <= f.z / TILE_SIZE; x++) {
+					unsigned int tile = y * tilesX + x;
+					if (pass == 0)
+						tileStart[tile + 1]++;
+					else
+						tileTris[tileStart[tile]++] = i;
+				}
+		}
+		if (pass == 0) {
+			for (unsigned int k = 0; k < tileCount; k++)
+				tileStart[k + 1] += tileStart[k];
+			tileTris.resize(tileStart[tileCount]);
+		} else {
+			// Filling advanced every start to the next tile's start
+			for (unsigned int k = tileCount; k > 0; k--)
+				tileStart[k] = tileStart[k - 1];
+			tileStart[0] = 0;
+		}
+	}
+}
+
+bool TileBins::intersect(int x, int y, const Ray& ray, Hit& hit) const {
+	hit = Hit();
+	unsigned int tile = tileOf(x, y);
+	// Triangles whose footprint covers the pixel are tested a batch at a time
+	unsigned int batch[BATCH_SIZE];
+	unsigned int batchCount = 0;
+	for (unsigned int i = tileStart[tile]; i < tileStart[tile + 1]; i++) {
+		unsigned int tri = tileTris[i];
+		const i16vec4& f = footprints[tri];
+		if (x < f.x || y < f.y || x > f.z || y > f.w)
+			continue;
+		batch[batchCount++] = tri;
+		if (batchCount == BATCH_SIZE) {
+			tris->intersect(ray, batch, batchCount, hit.t, hit.triIdx);
+			batchCount = 0;
+		}
+	}
+	if (batchCount > 0)
+		tris->intersect(ray, batch, batchCount, hit.t, hit.triIdx);
+	if (!hit.valid())
+		return false;
+	tris->intersect(ray, hit.triIdx, hit.bary);
+	return true;
+}
+
+bool TileBins::intersect(int x, int y, const vec4& uvst, Hit& hit) const {
+	hit = Hit();
+	float uvts = uvst.x * uvst.w - uvst.y * uvst.z;
+	unsigned int tile = tileOf(x, y);
+	for (unsigned int i = tileStart[tile]; i < tileStart[tile + 1]; i++) {
+		unsigned int tri = tileTris[i];
+		const i16vec4& f = footprints[tri];
+		if (x < f.x || y < f.y || x > f.z || y > f.w)
+			continue;
+		// Lists are in ascending triangle order, so a tie keeps the lower index
+		float t = glcTris.intersect(uvst, uvts, tri);
+		if (t >= 0.0f && t < hit.t) {
+			hit.t = t;
+			hit.triIdx = tri;
+		}
+	}
+	if (!hit.valid())
+		return false;
+	glcTris.intersect(uvst, uvts, hit.triIdx, hit.bary);
+	return true;
+}
+
+float TileBins::averageListLength() const {
+	unsigned int tileCount = tilesX * tilesY;
+	return tileCount ? (float)tileTris.size() / tileCount : 0.0f;
+}
@@ -0,0 +1,56 @@
+#ifndef TILEBIN_HPP
+#define TILEBIN_HPP
+
+#include <vector>
+#include <glm/glm.hpp>
+#include <glm/gtc/type_precision.hpp>
+#include "mesh.hpp"
+#include "ray.hpp"
+#include "tristore.hpp"
+#include "twoplane.hpp"
+
+// Triangle lists of square pixel tiles, filled by projecting the triangles through the GLC
+// A GLC maps a scene point to image plane (s, t) in closed form. When s and t are each a linear
+// fraction of the point (perspective, orthogonal, pushbroom), the box of a triangle's projected
+// vertices bounds its footprint, and each tile only has to test the triangles binned into it
+class TileBins {
+public:
+	TileBins();
+
+	static const int TILE_SIZE = 16;	// Tile width and height in pixels
+
+	// Whether the forward projection of this GLC is a linear fraction per image axis
+	static bool supported(const std::vector<glm::vec3>& imagePlaneVerts, const std::vector<glm::vec3>& uvPlaneVerts);
+
+	// Bin object space triangles placed by objToWorld, for an image of width x height
+	// pixels spanning clipW x clipH on the image plane (the mapping of texData2WorldCoords)
+	// The store is referenced, not copied, and must outlive the bins
+	void build(const std::vector<glm::vec3>& imagePlaneVerts, const std::vector<glm::vec3>& uvPlaneVerts,
+		const TriangleStore& tris, const glm::mat4& objToWorld,
+		int width, int height, float clipW, float clipH);
+	void clear();
+
+	// Closest hit of the object space ray of pixel (x, y) among the triangles binned over it,
+	// return false if nothing is hit
+	bool intersect(int x, int y, const Ray& ray, Hit& hit) const;
+	// Same for the world space GLC ray of the pixel, tested through its two-plane coordinates
+	bool intersect(int x, int y, const glm::vec4& uvst, Hit& hit) const;
+	// Tile of a pixel
+	unsigned int tileOf(int x, int y) const { return (y / TILE_SIZE) * tilesX + x / TILE_SIZE; }
+	// Average number of triangles listed per tile
+	float averageListLength() const;
+
+	// Tile k lists tileTris[tileStart[k], tileStart[k + 1]), in ascending triangle order
+	int tilesX, tilesY;
+	std::vector<unsigned int> tileStart;
+	std::vector<unsigned int> tileTris;
+	// Pixel footprint of each triangle (first x, first y, last x, last y), tested before the ray
+	std::vector<glm::i16vec4> footprints;
+	// Two-plane coefficients of the triangles under the transform of the frame
+	TwoPlaneTriangles glcTris;
+
+protected:
+	const TriangleStore* tris;	// Triangles the bins were built over
+};
+
+#endif
@@ -0,0 +1,337 @@
+#include "tristore.hpp"
+#include <algorithm>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+using namespace std;
+using namespace glm;
+
+// Wider kernels are compiled for their instruction set only, and run only where CPUID reports it
+// The AVX-512 kernel must not fuse multiplies and adds, or it would round unlike the scalar test
+#ifdef _MSC_VER
+#define TARGET_AVX2
+#define TARGET_AVX512
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f"), optimize("fp-contract=off")))
+#endif
+
+// Kernels read either listed slots, gathering each lane, or a slot range, loading the lanes at
+// once. Position i of a test is slotList[i] or slot i
+template <bool RANGE>
+static inline unsigned int laneSlot(const unsigned int* slotList, unsigned int i) {
+	return RANGE ? i : slotList[i];
+}
+
+// Lanes of a pass that lie before the end of the test
+static inline unsigned int laneMask(unsigned int remaining, unsigned int width) {
+	return remaining >= width ? (1u << width) - 1 : (1u << remaining) - 1;
+}
+
+// Fold the hit lanes of the pass starting at position i into the closest hit, ties go to the
+// lower triangle index like a linear scan
+template <bool RANGE>
+static bool mergeHits(const TriangleStore& s, unsigned int mask, const float* t, const unsigned int* slotList, unsigned int i,
+	float& tHit, unsigned int& triIdx) {
+	bool hit = false;
+	for (unsigned int k = 0; mask != 0; k++, mask >>= 1) {
+		if (!(mask & 1))
+			continue;
+		unsigned int tri = s.ids[laneSlot<RANGE>(slotList, i + k)];
+		if (t[k] < tHit || (t[k] == tHit && tri < triIdx)) {
+			tHit = t[k];
+			triIdx = tri;
+			hit = true;
+		}
+	}
+	return hit;
+}
+
+// Each kernel repeats the operations of TriangleStore::intersect in the same order. Comparisons
+// are negated where the scalar test rejects, so NaNs pass and fail the same way. Gathered lanes
+// past the end repeat the last slot, loaded ones read the next slots or the padding, and both
+// are masked out before merging. Hits count from tMin on; the any-hit variants (ANY) also drop
+// hits beyond tHit and return at the first pass that keeps one
+
+template <bool RANGE>
+static inline __m128 load4(const vector<float>& a, const unsigned int* lanes) {
+	if (RANGE)
+		return _mm_loadu_ps(&a[lanes[0]]);
+	return _mm_setr_ps(a[lanes[0]], a[lanes[1]], a[lanes[2]], a[lanes[3]]);
+}
+
+template <bool RANGE, bool ANY>
+static bool intersectSSE(const TriangleStore& s, const Ray& ray, const unsigned int* slotList, unsigned int first, unsigned int count,
+	float tMin, float& tHit, unsigned int& triIdx) {
+	__m128 ox = _mm_set1_ps(ray.orig.x), oy = _mm_set1_ps(ray.orig.y), oz = _mm_set1_ps(ray.orig.z);
+	__m128 dx = _mm_set1_ps(ray.dir.x), dy = _mm_set1_ps(ray.dir.y), dz = _mm_set1_ps(ray.dir.z);
+	__m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f), parallel = _mm_set1_ps(0.001f);
+	__m128 sign = _mm_set1_ps(-0.0f), lower = _mm_set1_ps(tMin), upper = _mm_set1_ps(tHit);
+	unsigned int end = first + count;
+	bool hit = false;
+	for (unsigned int i = first; i < end; i += 4) {
+		unsigned int l[4];
+		for (unsigned int k = 0; k < 4; k++)
+			l[k] = laneSlot<RANGE>(slotList, RANGE ? i + k : std::min(i + k, end - 1));
+
+		__m128 nx = load4<RANGE>(s.nx, l), ny = load4<RANGE>(s.ny, l), nz = load4<RANGE>(s.nz, l);
+		__m128 nd = _mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, dx), _mm_mul_ps(ny, dy)), _mm_mul_ps(nz, dz));
+		__m128 ok = _mm_cmpnlt_ps(_mm_andnot_ps(sign, nd), parallel);
+
+		__m128 e1x = load4<RANGE>(s.e1x, l), e1y = load4<RANGE>(s.e1y, l), e1z = load4<RANGE>(s.e1z, l);
+		__m128 e2x = load4<RANGE>(s.e2x, l), e2y = load4<RANGE>(s.e2y, l), e2z = load4<RANGE>(s.e2z, l);
+		__m128 px = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(e2y, dz));
+		__m128 py = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(e2z, dx));
+		__m128 pz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(e2x, dy));
+		__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+		__m128 invDet = _mm_div_ps(one, det);
+
+		__m128 sx = _mm_sub_ps(ox, load4<RANGE>(s.v0x, l));
+		__m128 sy = _mm_sub_ps(oy, load4<RANGE>(s.v0y, l));
+		__m128 sz = _mm_sub_ps(oz, load4<RANGE>(s.v0z, l));
+		__m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), invDet);
+		ok = _mm_and_ps(ok, _mm_and_ps(_mm_cmpnlt_ps(u, zero), _mm_cmpngt_ps(u, one)));
+
+		__m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(e1y, sz));
+		__m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(e1z, sx));
+		__m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(e1x, sy));
+		__m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)), invDet);
+		ok = _mm_and_ps(ok, _mm_and_ps(_mm_cmpnlt_ps(v, zero), _mm_cmpngt_ps(_mm_add_ps(u, v), one)));
+
+		__m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), invDet);
+		ok = _mm_and_ps(ok, _mm_cmpge_ps(t, lower));
+		if (ANY)
+			ok = _mm_and_ps(ok, _mm_cmple_ps(t, upper));
+
+		unsigned int mask = _mm_movemask_ps(ok) & laneMask(end - i, 4);
+		if (mask == 0)
+			continue;
+		if (ANY)
+			return true;
+		float tLanes[4];
+		_mm_storeu_ps(tLanes, t);
+		if (mergeHits<RANGE>(s, mask, tLanes, slotList, i, tHit, triIdx))
+			hit = true;
+	}
+	return hit;
+}
+
+template <bool RANGE>
+TARGET_AVX2 static inline __m256 load8(const vector<float>& a, unsigned int i, __m256i idx) {
+	if (RANGE)
+		return _mm256_loadu_ps(&a[i]);
+	return _mm256_i32gather_ps(&a[0], idx, 4);
+}
+
+template <bool RANGE, bool ANY>
+TARGET_AVX2 static bool intersectAVX2(const TriangleStore& s, const Ray& ray, const unsigned int* slotList, unsigned int first, unsigned int count,
+	float tMin, float& tHit, unsigned int& triIdx) {
+	__m256 ox = _mm256_set1_ps(ray.orig.x), oy = _mm256_set1_ps(ray.orig.y), oz = _mm256_set1_ps(ray.orig.z);
+	__m256 dx = _mm256_set1_ps(ray.dir.x), dy = _mm256_set1_ps(ray.dir.y), dz = _mm256_set1_ps(ray.dir.z);
+	__m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f), parallel = _mm256_set1_ps(0.001f);
+	__m256 sign = _mm256_set1_ps(-0.0f), lower = _mm256_set1_ps(tMin), upper = _mm256_set1_ps(tHit);
+	unsigned int end = first + count;
+	bool hit = false;
+	for (unsigned int i = first; i < end; i += 8) {
+		__m256i idx = _mm256_setzero_si256();
+		if (!RANGE) {
+			unsigned int l[8];
+			for (unsigned int k = 0; k < 8; k++)
+				l[k] = slotList[std::min(i + k, end - 1)];
+			idx = _mm256_loadu_si256((const __m256i*)l);
+		}
+
+		__m256 nx = load8<RANGE>(s.nx, i, idx), ny = load8<RANGE>(s.ny, i, idx), nz = load8<RANGE>(s.nz, i, idx);
+		__m256 nd = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx, dx), _mm256_mul_ps(ny, dy)), _mm256_mul_ps(nz, dz));
+		__m256 ok = _mm256_cmp_ps(_mm256_andnot_ps(sign, nd), parallel, _CMP_NLT_UQ);
+
+		__m256 e1x = load8<RANGE>(s.e1x, i, idx), e1y = load8<RANGE>(s.e1y, i, idx), e1z = load8<RANGE>(s.e1z, i, idx);
+		__m256 e2x = load8<RANGE>(s.e2x, i, idx), e2y = load8<RANGE>(s.e2y, i, idx), e2z = load8<RANGE>(s.e2z, i, idx);
+		__m256 px = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(e2y, dz));
+		__m256 py = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(e2z, dx));
+		__m256 pz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(e2x, dy));
+		__m256 det = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e1x, px), _mm256_mul_ps(e1y, py)), _mm256_mul_ps(e1z, pz));
+		__m256 invDet = _mm256_div_ps(one, det);
+
+		__m256 sx = _mm256_sub_ps(ox, load8<RANGE>(s.v0x, i, idx));
+		__m256 sy = _mm256_sub_ps(oy, load8<RANGE>(s.v0y, i, idx));
+		__m256 sz = _mm256_sub_ps(oz, load8<RANGE>(s.v0z, i, idx));
+		__m256 u = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, px), _mm256_mul_ps(sy, py)), _mm256_mul_ps(sz, pz)), invDet);
+		ok = _mm256_and_ps(ok, _mm256_and_ps(_mm256_cmp_ps(u, zero, _CMP_NLT_UQ), _mm256_cmp_ps(u, one, _CMP_NGT_UQ)));
+
+		__m256 qx = _mm256_sub_ps(_mm256_mul_ps(sy, e1z), _mm256_mul_ps(e1y, sz));
+		__m256 qy = _mm256_sub_ps(_mm256_mul_ps(sz, e1x), _mm256_mul_ps(e1z, sx));
+		__m256 qz = _mm256_sub_ps(_mm256_mul_ps(sx, e1y), _mm256_mul_ps(e1x, sy));
+		__m256 v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)), _mm256_mul_ps(dz, qz)), invDet);
+		ok = _mm256_and_ps(ok, _mm256_and_ps(_mm256_cmp_ps(v, zero, _CMP_NLT_UQ),
+			_mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_NGT_UQ)));
+
+		__m256 t = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)), _mm256_mul_ps(e2z, qz)), invDet);
+		ok = _mm256_and_ps(ok, _mm256_cmp_ps(t, lower, _CMP_GE_OQ));
+		if (ANY)
+			ok = _mm256_and_ps(ok, _mm256_cmp_ps(t, upper, _CMP_LE_OQ));
+
+		unsigned int mask = _mm256_movemask_ps(ok) & laneMask(end - i, 8);
+		if (mask == 0)
+			continue;
+		if (ANY)
+			return true;
+		float tLanes[8];
+		_mm256_storeu_ps(tLanes, t);
+		if (mergeHits<RANGE>(s, mask, tLanes, slotList, i, tHit, triIdx))
+			hit = true;
+	}
+	return hit;
+}
+
+template <bool RANGE>
+TARGET_AVX512 static inline __m512 load16(const vector<float>& a, unsigned int i, __m512i idx) {
+	if (RANGE)
+		return _mm512_loadu_ps(&a[i]);
+	// Masked form with a zeroed source, GCC warns that the plain gather's undefined source may be used
+	return _mm512_mask_i32gather_ps(_mm512_setzero_ps(), 0xFFFF, idx, &a[0], 4);
+}
+
+template <bool RANGE, bool ANY>
+TARGET_AVX512 static bool intersectAVX512(const TriangleStore& s, const Ray& ray, const unsigned int* slotList, unsigned int first, unsigned int count,
+	float tMin, float& tHit, unsigned int& triIdx) {
+	__m512 ox = _mm512_set1_ps(ray.orig.x), oy = _mm512_set1_ps(ray.orig.y), oz = _mm512_set1_ps(ray.orig.z);
+	__m512 dx = _mm512_set1_ps(ray.dir.x), dy = _mm512_set1_ps(ray.dir.y), dz = _mm512_set1_ps(ray.dir.z);
+	__m512 zero = _mm512_setzero_ps(), one = _mm512_set1_ps(1.0f), parallel = _mm512_set1_ps(0.001f);
+	__m512 lower = _mm512_set1_ps(tMin), upper = _mm512_set1_ps(tHit);
+	unsigned int end = first + count;
+	bool hit = false;
+	for (unsigned int i = first; i < end; i += 16) {
+		__m512i idx = _mm512_setzero_si512();
+		if (!RANGE) {
+			unsigned int l[16];
+			for (unsigned int k = 0; k < 16; k++)
+				l[k] = slotList[std::min(i + k, end - 1)];
+			idx = _mm512_loadu_si512(l);
+		}
+
+		__m512 nx = load16<RANGE>(s.nx, i, idx), ny = load16<RANGE>(s.ny, i, idx), nz = load16<RANGE>(s.nz, i, idx);
+		__m512 nd = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(nx, dx), _mm512_mul_ps(ny, dy)), _mm512_mul_ps(nz, dz));
+		__mmask16 ok = _mm512_cmp_ps_mask(_mm512_abs_ps(nd), parallel, _CMP_NLT_UQ);
+
+		__m512 e1x = load16<RANGE>(s.e1x, i, idx), e1y = load16<RANGE>(s.e1y, i, idx), e1z = load16<RANGE>(s.e1z, i, idx);
+		__m512 e2x = load16<RANGE>(s.e2x, i, idx), e2y = load16<RANGE>(s.e2y, i, idx), e2z = load16<RANGE>(s.e2z, i, idx);
+		__m512 px = _mm512_sub_ps(_mm512_mul_ps(dy, e2z), _mm512_mul_ps(e2y, dz));
+		__m512 py = _mm512_sub_ps(_mm512_mul_ps(dz, e2x), _mm512_mul_ps(e2z, dx));
+		__m512 pz = _mm512_sub_ps(_mm512_mul_ps(dx, e2y), _mm512_mul_ps(e2x, dy));
+		__m512 det = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(e1x, px), _mm512_mul_ps(e1y, py)), _mm512_mul_ps(e1z, pz));
+		__m512 invDet = _mm512_div_ps(one, det);
+
+		__m512 sx = _mm512_sub_ps(ox, load16<RANGE>(s.v0x, i, idx));
+		__m512 sy = _mm512_sub_ps(oy, load16<RANGE>(s.v0y, i, idx));
+		__m512 sz = _mm512_sub_ps(oz, load16<RANGE>(s.v0z, i, idx));
+		__m512 u = _mm512_mul_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(sx, px), _mm512_mul_ps(sy, py)), _mm512_mul_ps(sz, pz)), invDet);
+		ok &= _mm512_cmp_ps_mask(u, zero, _CMP_NLT_UQ) & _mm512_cmp_ps_mask(u, one, _CMP_NGT_UQ);
+
+		__m512 qx = _mm512_sub_ps(_mm512_mul_ps(sy, e1z), _mm512_mul_ps(e1y, sz));
+		__m512 qy = _mm512_sub_ps(_mm512_mul_ps(sz, e1x), _mm512_mul_ps(e1z, sx));
+		__m512 qz = _mm512_sub_ps(_mm512_mul_ps(sx, e1y), _mm512_mul_ps(e1x, sy));
+		__m512 v = _mm512_mul_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dx, qx), _mm512_mul_ps(dy, qy)), _mm512_mul_ps(dz, qz)), invDet);
+		ok &= _mm512_cmp_ps_mask(v, zero, _CMP_NLT_UQ) & _mm512_cmp_ps_mask(_mm512_add_ps(u, v), one, _CMP_NGT_UQ);
+
+		__m512 t = _mm512_mul_ps(_mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(e2x, qx), _mm512_mul_ps(e2y, qy)), _mm512_mul_ps(e2z, qz)), invDet);
+		ok &= _mm512_cmp_ps_mask(t, lower, _CMP_GE_OQ);
+		if (ANY)
+			ok &= _mm512_cmp_ps_mask(t, upper, _CMP_LE_OQ);
+
+		unsigned int mask = ok & laneMask(end - i, 16);
+		if (mask == 0)
+			continue;
+		if (ANY)
+			return true;
+		float tLanes[16];
+		_mm512_storeu_ps(tLanes, t);
+		if (mergeHits<RANGE>(s, mask, tLanes, slotList, i, tHit, triIdx))
+			hit = true;
+	}
+	return hit;
+}
+
+// Whether the CPU has the instructions of a kernel and the OS saves their registers
+static bool cpuSupports(TriangleStore::Kernel kernel) {
+	if (kernel == TriangleStore::KERNEL_SSE)
+		return true;
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return false;
+	__cpuid(info, 1);
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	if (!osxsave)
+		return false;
+	unsigned long long xcr0 = _xgetbv(0);
+	__cpuidex(info, 7, 0);
+	if (kernel == TriangleStore::KERNEL_AVX2)
+		return (xcr0 & 0x6) == 0x6 && (info[1] & (1 << 5)) != 0;
+	return (xcr0 & 0xE6) == 0xE6 && (info[1] & (1 << 16)) != 0;
+#else
+	__builtin_cpu_init();
+	if (kernel == TriangleStore::KERNEL_AVX2)
+		return __builtin_cpu_supports("avx2");
+	return __builtin_cpu_supports("avx512f");
+#endif
+}
+
+typedef bool (*KernelFunc)(const TriangleStore&, const Ray&, const unsigned int*, unsigned int, unsigned int,
+	float, float&, unsigned int&);
+static const KernelFunc listKernels[] = { intersectSSE<false, false>, intersectAVX2<false, false>, intersectAVX512<false, false> };
+static const KernelFunc rangeKernels[] = { intersectSSE<true, false>, intersectAVX2<true, false>, intersectAVX512<true, false> };
+static const KernelFunc listAnyKernels[] = { intersectSSE<false, true>, intersectAVX2<false, true>, intersectAVX512<false, true> };
+static const KernelFunc rangeAnyKernels[] = { intersectSSE<true, true>, intersectAVX2<true, true>, intersectAVX512<true, true> };
+static TriangleStore::Kernel currentKernel = TriangleStore::bestKernel();
+
+TriangleStore::Kernel TriangleStore::bestKernel() {
+	static const Kernel best = cpuSupports(KERNEL_AVX512) ? KERNEL_AVX512 :
+		cpuSupports(KERNEL_AVX2) ? KERNEL_AVX2 : KERNEL_SSE;
+	return best;
+}
+
+bool TriangleStore::useKernel(Kernel kernel) {
+	if (!cpuSupports(kernel))
+		return false;
+	currentKernel = kernel;
+	return true;
+}
+
+TriangleStore::Kernel TriangleStore::kernel() {
+	return currentKernel;
+}
+
+const char* TriangleStore::kernelName(Kernel kernel) {
+	const char* names[] = { "SSE", "AVX2", "AVX-512" };
+	return names[kernel];
+}
+
+// Narrowest enabled kernel that still tests count triangles in one pass
+static inline TriangleStore::Kernel kernelFor(unsigned int count) {
+	TriangleStore::Kernel fit = count <= 4 ? TriangleStore::KERNEL_SSE :
+		count <= 8 ? TriangleStore::KERNEL_AVX2 : TriangleStore::KERNEL_AVX512;
+	return std::min(fit, currentKernel);
+}
+
+bool TriangleStore::intersect(const Ray& ray, const unsigned int* slotList, unsigned int count,
+	float& tHit, unsigned int& triIdx) const {
+	return count > 0 && listKernels[kernelFor(count)](*this, ray, slotList, 0, count, 0.0f, tHit, triIdx);
+}
+
+bool TriangleStore::intersectRange(const Ray& ray, unsigned int first, unsigned int count,
+	float& tHit, unsigned int& triIdx) const {
+	return count > 0 && rangeKernels[kernelFor(count)](*this, ray, NULL, first, count, 0.0f, tHit, triIdx);
+}
+
+bool TriangleStore::occluded(const Ray& ray, const unsigned int* slotList, unsigned int count, float tMin, float tMax) const {
+	unsigned int unused;
+	return count > 0 && listAnyKernels[kernelFor(count)](*this, ray, slotList, 0, count, std::max(tMin, 0.0f), tMax, unused);
+}
+
+bool TriangleStore::occludedRange(const Ray& ray, unsigned int first, unsigned int count, float tMin, float tMax) const {
+	unsigned int unused;
+	return count > 0 && rangeAnyKernels[kernelFor(count)](*this, ray, NULL, first, count, std::max(tMin, 0.0f), tMax, unused);
+}
@@ -0,0 +1,58 @@
+#include "tristore.hpp"
+using namespace std;
+using namespace glm;
+
+TriangleStore::TriangleStore() {
+	verts = NULL;
+}
+
+void TriangleStore::clear() {
+	vector<float>* arrays[] = { &v0x, &v0y, &v0z, &e1x, &e1y, &e1z, &e2x, &e2y, &e2z, &nx, &ny, &nz };
+	for (int a = 0; a < 12; a++)
+		arrays[a]->clear();
+	ids.clear();
+	verts = NULL;
+}
+
+void TriangleStore::build(const vector<Mesh::Vtx>& verts) {
+	// Mesh order, slot i holds triangle i
+	vector<unsigned int> order(verts.size() / 3);
+	for (unsigned int i = 0; i < order.size(); i++)
+		order[i] = i;
+	build(verts, order);
+}
+
+void TriangleStore::build(const vector<Mesh::Vtx>& verts, const vector<unsigned int>& order) {
+	clear();
+	this->verts = &verts;
+	ids = order;
+	unsigned int slotCount = order.size();
+	// Padding slots stay zero, their zero normal makes them miss every ray
+	vector<float>* arrays[] = { &v0x, &v0y, &v0z, &e1x, &e1y, &e1z, &e2x, &e2y, &e2z, &nx, &ny, &nz };
+	for (int a = 0; a < 12; a++)
+		arrays[a]->resize(slotCount + PADDING, 0.0f);
+
+	for (unsigned int i = 0; i < slotCount; i++) {
+		const Mesh::Vtx* triangle = &verts[3 * order[i]];
+		vec3 e1 = triangle[1].pos - triangle[0].pos;
+		vec3 e2 = triangle[2].pos - triangle[0].pos;
+		v0x[i] = triangle[0].pos.x;
+		v0y[i] = triangle[0].pos.y;
+		v0z[i] = triangle[0].pos.z;
+		e1x[i] = e1.x;
+		e1y[i] = e1.y;
+		e1z[i] = e1.z;
+		e2x[i] = e2.x;
+		e2y[i] = e2.y;
+		e2z[i] = e2.z;
+		// Face normal from the winding, the vertices' own normals are not read
+		vec3 n = normalize(cross(e1, e2));
+		nx[i] = n.x;
+		ny[i] = n.y;
+		nz[i] = n.z;
+	}
+}
+
+size_t TriangleStore::memoryUsage() const {
+	return (12 * (size() + PADDING)) * sizeof(float) + ids.size() * sizeof(unsigned int);
+}
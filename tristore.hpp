@@ -0,0 +1,110 @@
+#ifndef TRISTORE_HPP
+#define TRISTORE_HPP
+
+#include <cmath>
+#include <vector>
+#include <glm/glm.hpp>
+#include "mesh.hpp"
+#include "ray.hpp"
+
+// Triangles prepared for ray tests, built once per mesh and shared by every structure over it
+// Each component has its own array (first vertex, the two edges leaving it, unit face normal),
+// so a test reads 12 floats in place instead of three full vertices, and wide kernels can load
+// the same component of neighboring triangles at once
+class TriangleStore {
+public:
+	TriangleStore();
+
+	// Build from a triangle list (3 vertices per triangle), face normals are computed from the positions
+	// The vertex list is referenced, not copied, and must outlive the store
+	void build(const std::vector<Mesh::Vtx>& verts);
+	// Build with slot k holding triangle order[k], so that triangles tested together sit side by side
+	void build(const std::vector<Mesh::Vtx>& verts, const std::vector<unsigned int>& order);
+	void clear();
+
+	unsigned int size() const { return ids.size(); }
+	bool empty() const { return ids.empty(); }
+	// Vertex list the store was built from, used for bounds while building structures
+	const std::vector<Mesh::Vtx>& vertices() const { return *verts; }
+	// Memory used by the prepared triangles in bytes
+	size_t memoryUsage() const;
+	// Unit face normal of the triangle in a slot, the shading normal of its hits
+	glm::vec3 normal(unsigned int slot) const { return glm::vec3(nx[slot], ny[slot], nz[slot]); }
+
+	// Intersect a ray with the triangle in a slot
+	// Returns the ray distance t of the hit, or a negative value if there is none
+	float intersect(const Ray& ray, unsigned int slot) const;
+	// Same, also storing the barycentric coordinates of the hit (weights of the second and third vertices)
+	float intersect(const Ray& ray, unsigned int slot, glm::vec2& bary) const;
+	// Closest hit among count listed slots, tested 4, 8 or 16 at a time by the widest SIMD kernel
+	// the CPU supports. Updates tHit and triIdx (a triangle index) when a triangle is hit closer
+	// than tHit, or as close with a lower index, and returns whether it did
+	bool intersect(const Ray& ray, const unsigned int* slotList, unsigned int count, float& tHit, unsigned int& triIdx) const;
+	// Same for the slots [first, first + count), loaded directly instead of gathered
+	bool intersectRange(const Ray& ray, unsigned int first, unsigned int count, float& tHit, unsigned int& triIdx) const;
+	// Whether any listed slot, or any slot of [first, first + count), is hit within [tMin, tMax]
+	// Stops at the first pass of the kernel that finds a hit
+	bool occluded(const Ray& ray, const unsigned int* slotList, unsigned int count, float tMin, float tMax) const;
+	bool occludedRange(const Ray& ray, unsigned int first, unsigned int count, float tMin, float tMax) const;
+
+	// Kernels of the list test, all of them match testing the triangles one by one bit for bit
+	enum Kernel { KERNEL_SSE, KERNEL_AVX2, KERNEL_AVX512 };
+	// Widest kernel the CPU and OS support, picked at startup
+	static Kernel bestKernel();
+	// Switch the kernel of the list test, returns false if this CPU cannot run it
+	static bool useKernel(Kernel kernel);
+	static Kernel kernel();
+	static const char* kernelName(Kernel kernel);
+
+	std::vector<float> v0x, v0y, v0z;	// First vertex
+	std::vector<float> e1x, e1y, e1z;	// Second vertex - first vertex
+	std::vector<float> e2x, e2y, e2z;	// Third vertex - first vertex
+	std::vector<float> nx, ny, nz;		// Unit face normal
+	std::vector<unsigned int> ids;		// Triangle index of each slot
+	// The component arrays run this far past the last slot, so wide loads stay in bounds
+	static const unsigned int PADDING = 15;
+
+protected:
+	const std::vector<Mesh::Vtx>* verts;	// Triangle list the store was built from
+
+private:
+	// Disallow copy, the structures reference the store
+	TriangleStore(const TriangleStore& other);
+	TriangleStore& operator=(const TriangleStore& other);
+};
+
+// Inner loop of every structure, so it is defined here where their loops can inline it
+inline float TriangleStore::intersect(const Ray& ray, unsigned int slot) const {
+	glm::vec2 bary;
+	return intersect(ray, slot, bary);
+}
+
+inline float TriangleStore::intersect(const Ray& ray, unsigned int slot, glm::vec2& bary) const {
+	const float miss = -1.0f;
+
+	// Rays (nearly) parallel to the triangle plane never hit it
+	glm::vec3 norm(nx[slot], ny[slot], nz[slot]);
+	if (std::fabs(glm::dot(norm, ray.dir)) < 0.001f)
+		return miss;
+
+	// Barycentric coordinates of the hit on the plane (Moller-Trumbore), edges included
+	glm::vec3 e1(e1x[slot], e1y[slot], e1z[slot]);
+	glm::vec3 e2(e2x[slot], e2y[slot], e2z[slot]);
+	glm::vec3 p = glm::cross(ray.dir, e2);
+	float invDet = 1.0f / glm::dot(e1, p);
+	glm::vec3 s = ray.orig - glm::vec3(v0x[slot], v0y[slot], v0z[slot]);
+	float u = glm::dot(s, p) * invDet;
+	if (u < 0.0f || u > 1.0f)
+		return miss;
+	glm::vec3 q = glm::cross(s, e1);
+	float v = glm::dot(ray.dir, q) * invDet;
+	if (v < 0.0f || u + v > 1.0f)
+		return miss;
+
+	// Return the distance along the ray
+	float t = glm::dot(e2, q) * invDet;
+	bary = glm::vec2(u, v);
+	return t >= 0.0f ? t : miss;
+}
+
+#endif
@@ -0,0 +1,46 @@
+#include "twoplane.hpp"
+using namespace std;
+using namespace glm;
+
+void TwoPlaneTriangles::clear() {
+	coeffs.clear();
+}
+
+void TwoPlaneTriangles::build(const TriangleStore& tris, const mat4& objToWorld) {
+	const vector<Mesh::Vtx>& verts = tris.vertices();
+	unsigned int triCount = verts.size() / 3;
+	coeffs.resize(triCount);
+	// Normals go to world space by the inverse transpose, so that normal dot direction is unchanged
+	mat3 normalToWorld = transpose(inverse(mat3(objToWorld)));
+
+	for (unsigned int i = 0; i < triCount; i++) {
+		vec3 w[3];
+		for (int k = 0; k < 3; k++)
+			w[k] = vec3(objToWorld * vec4(verts[3 * i + k].pos, 1.0f));
+		Coeffs& c = coeffs[i];
+
+		// A ray has direction d = (s - u, t - v, -1) and moment m = (u, v, 1) x (s, t, 0) = (-t, s, u t - v s),
+		// its side against the edge p -> q is d . (p x q) + (q - p) . m
+		for (int k = 0; k < 3; k++) {
+			const vec3& p = w[(k + 1) % 3];
+			const vec3& q = w[(k + 2) % 3];
+			vec3 d = q - p;
+			vec3 m = cross(p, q);
+			float* e = c.edge[k];
+			e[0] = -m.z;
+			e[1] = -m.x;
+			e[2] = -m.y;
+			e[3] = m.x + d.y;
+			e[4] = m.y - d.x;
+			e[5] = d.z;
+			c.z[k] = w[k].z;
+		}
+
+		vec3 g = normalToWorld * tris.normal(i);
+		c.facing[0] = -g.z;
+		c.facing[1] = -g.x;
+		c.facing[2] = -g.y;
+		c.facing[3] = g.x;
+		c.facing[4] = g.y;
+	}
+}
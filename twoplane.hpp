@@ -0,0 +1,80 @@
+#ifndef TWOPLANE_HPP
+#define TWOPLANE_HPP
+
+#include <cmath>
+#include <vector>
+#include <glm/glm.hpp>
+#include "ray.hpp"
+#include "tristore.hpp"
+
+// Triangles prepared for GLC rays given by their two-plane coordinates (u, v, s, t): the ray
+// leaves (u, v) on the uv plane (z = 1) and reaches (s, t) on the image plane (z = 0) at t = 1
+// The Plucker side of such a ray against a fixed edge is c0 + cu u + cv v + cs s + ct t + cw (u t - v s),
+// so with the coefficients of a triangle's edges prepared in world space, a ray test is a few
+// multiply-adds per edge and no cross products. The ray distance comes from interpolating the
+// vertices' heights with the three sides, which are proportional to the barycentric coordinates
+class TwoPlaneTriangles {
+public:
+	// Prepare the coefficients of object space triangles placed by objToWorld
+	// Must be rebuilt whenever the transform changes
+	void build(const TriangleStore& tris, const glm::mat4& objToWorld);
+	void clear();
+
+	unsigned int size() const { return coeffs.size(); }
+
+	// Two-plane coordinates of a world space GLC ray as GLCCamera makes them
+	static glm::vec4 coordinates(const Ray& ray) {
+		return glm::vec4(ray.orig.x, ray.orig.y, ray.orig.x + ray.dir.x, ray.orig.y + ray.dir.y);
+	}
+
+	// Intersect the ray with two-plane coordinates uvst with triangle tri, uvts is u t - v s
+	// Returns the ray distance t of the hit, or a negative value if there is none
+	// Agrees with TriangleStore::intersect on the object space ray up to rounding
+	float intersect(const glm::vec4& uvst, float uvts, unsigned int tri) const;
+	// Same, also storing the barycentric coordinates of the hit, the second and third sides' shares
+	float intersect(const glm::vec4& uvst, float uvts, unsigned int tri, glm::vec2& bary) const;
+
+	// Coefficients of one triangle
+	struct Coeffs {
+		float edge[3][6];	// Side of the edge opposite each vertex: c0, cu, cv, cs, ct, cw
+		float facing[5];	// Object space normal dot direction: c0, cu, cv, cs, ct
+		float z[3];			// World height of each vertex
+	};
+	std::vector<Coeffs> coeffs;
+};
+
+inline float TwoPlaneTriangles::intersect(const glm::vec4& uvst, float uvts, unsigned int tri) const {
+	glm::vec2 bary;
+	return intersect(uvst, uvts, tri, bary);
+}
+
+inline float TwoPlaneTriangles::intersect(const glm::vec4& uvst, float uvts, unsigned int tri, glm::vec2& bary) const {
+	const float miss = -1.0f;
+	const Coeffs& c = coeffs[tri];
+
+	// Same rejection of (nearly) parallel rays as the scalar test
+	const float* f = c.facing;
+	float facing = f[0] + f[1] * uvst.x + f[2] * uvst.y + f[3] * uvst.z + f[4] * uvst.w;
+	if (std::fabs(facing) < 0.001f)
+		return miss;
+
+	// The ray passes inside (edges included) when no side has the opposite sign of another
+	float side[3];
+	for (int k = 0; k < 3; k++) {
+		const float* e = c.edge[k];
+		side[k] = e[0] + e[1] * uvst.x + e[2] * uvst.y + e[3] * uvst.z + e[4] * uvst.w + e[5] * uvts;
+	}
+	bool negative = side[0] < 0.0f || side[1] < 0.0f || side[2] < 0.0f;
+	bool positive = side[0] > 0.0f || side[1] > 0.0f || side[2] > 0.0f;
+	if (negative == positive)
+		return miss;
+
+	// Height of the hit, the ray descends one unit of height per unit of t from z = 1
+	float invSum = 1.0f / (side[0] + side[1] + side[2]);
+	float z = (side[0] * c.z[0] + side[1] * c.z[1] + side[2] * c.z[2]) * invSum;
+	float t = 1.0f - z;
+	bary = glm::vec2(side[1] * invSum, side[2] * invSum);
+	return t >= 0.0f ? t : miss;
+}
+
+#endif